@@ -0,0 +1,58 @@
+/* Build configuration for the alarm clock firmware. Each build target
+   picks its options and features here or passes them with -D */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/* Build options, uncomment to enable */
+//#define BENCHMARK             // Report hot function cycle costs over the SCI at boot
+//#define PROFILE               // Stream main loop phase histograms over the SCI in debug
+//#define TRACE                 // Record inputs, RTC readings and display over the SCI
+//#define REPLAY                // Replay a recorded trace received over the SCI
+//#define STACK_CHECK           // Report the stack high water mark over the SCI in debug
+//#define LATENCY               // Report press to beep and press to display latency over the SCI in debug
+//#define BUS_LOG               // Report the last latch, SCI and I2C bus events over the SCI in debug
+//#define ENERGY                // Report activity and estimated current per mode over the SCI in debug
+//#define FLASH_STORE           // Keep the alarms and settings in on-chip flash instead of the EEPROM
+
+/* Features, uncomment to leave out of the build. A switch whose feature
+   is left out is ignored and its mode fixed, so the checks of it fold
+   away at compile time */
+//#define NO_DEBUG_CLOCK        // Fast debug clock on the debug switch
+//#define NO_12_HOUR            // 12 hour display, 24 hour only
+//#define NO_BUZZER             // Buzzer alarm, iPod only
+//#define NO_IPOD               // iPod alarm and control, buzzer only
+//#define NO_HOST               // Provisioning frames from a host over the SCI
+
+#if defined(NO_BUZZER) && defined(NO_IPOD)
+#error "The alarm needs the buzzer or the iPod"
+#endif
+
+/* Traced builds run the loop once per tick so every input it sees is recorded */
+#if defined(TRACE) || defined(REPLAY)
+#define TICK_LOCKED
+#endif
+
+/* Host frames would change state behind a trace, so traced builds go without */
+#if !defined(NO_HOST) && !defined(TICK_LOCKED)
+#define HOST
+#endif
+
+/* Builds with anything to say write a debug report while debugging */
+#if defined(PROFILE) || defined(STACK_CHECK) || defined(LATENCY) || defined(BUS_LOG) \
+    || defined(ENERGY)
+#define REPORTING
+#endif
+
+/* The report would land in the trace stream and be read back as records */
+#if defined(TICK_LOCKED) && defined(REPORTING)
+#error "TRACE and REPLAY cannot be built with a debug report option"
+#endif
+
+/* The buffers of any two of these reports outgrow the RAM left beside
+   the stack, STACK_CHECK adds none */
+#if defined(PROFILE) + defined(LATENCY) + defined(BUS_LOG) + defined(ENERGY) > 1
+#error "Only one of PROFILE, LATENCY, BUS_LOG and ENERGY fits in RAM"
+#endif
+
+#endif
@@ -14,6 +14,7 @@
 
 #include <hidef.h>      /* For EnableInterrupts macro */
 #include "derivative.h" /* Include peripheral declarations */
+#include "config.h"     /* Build options and features */
 
 /* The following puts the dummy interrupt service routine at
    location MY_ISR_ROM which is defined in the PRM file as
@@ -26,11 +27,8 @@ void dummyISR(void) {}
    the PRM file.*/
 #pragma CODE_SEG DEFAULT
 
-/* Implements the ASSERT macro */
-#define assert(x)      if(!(x)) {\
-                          DisableInterrupts;\
-                          for(;;) {}\
-                       }
+/* Implements the ASSERT macro, see fail() */
+#define assert(x)      if(!(x)) fail(__LINE__)
                        
 /* Defines the variable input as PTA bits 0-1, 4-5 */
 volatile struct {
@@ -63,6 +61,16 @@ volatile struct {
 #define debug_switch (!MyPTD.debug_switch)
 #define alarm_switch (!MyPTD.alarm_switch)
 
+/* Defines the variable switches as the switch bits packed above input */
+#define switches ((alarm_switch << 6) | (debug_switch << 5) | (mode_switch << 4))
+
+/* Defines when a tick has passed, replay runs ticks back to back */
+#ifdef REPLAY
+#define tick_expired TRUE
+#else
+#define tick_expired (T2SC_TOF == 1)
+#endif
+
 /* Defines the device addresses on the I2C bus */
 #define CLOCK_ADDR      0xD0    // DS1307 Clock
 #define EEPROM_ADDR     0xA0    // 24LC256 EEPROM
@@ -79,6 +87,8 @@ volatile struct {
 #define CLOCK_SEC_ADDR  0x00
 #define CLOCK_CTR_ADDR  0x07
 #define CLOCK_MODE_ADDR 0x06
+#define CLOCK_RAM_ADDR  0x08    // Battery backed RAM, 56 bytes
+#define CLOCK_TRIES     2       // Reads of the time before giving up
 
 /* Defines the internal clock control bits */
 #define CLOCK_CTR_BITS  0x11
@@ -89,6 +99,37 @@ volatile struct {
 #define EEPROM_MSB_ADDR 0x00
 #define EEPROM_ALM_ADDR 0x00
 
+/* Defines the eeprom write cycle constants */
+#define EEPROM_PAGE_SIZE  64    // Page write buffer, writes wrap within a page
+#define EEPROM_POLL_COUNT 50    // Acknowledge polls to cover the 5ms write cycle
+#define EEPROM_ACK_TIME 24      // Timer 1 counts to wait for an acknowledge, twice an address
+
+/* Defines the on-chip flash log, two erase pages reserved below the
+   vectors in the PRM file. Each record is a sequence number, the stored
+   page and a checksum, appended in order after the newest */
+#define FLASH_LOG       ((char *)0xF800)
+#define FLASH_PAGE_SIZE 512     // Log page, erased as a whole
+#define FLASH_ERASE_STEP 64     // Smallest erase page of the HC908 parts, see flash_erase()
+#define FLASH_PAGES     2
+#define FLASH_RECORD_SIZE (STORE_SIZE + 2)
+#define FLASH_RECORDS   (FLASH_PAGE_SIZE / FLASH_RECORD_SIZE)
+#define FLASH_ERASED    0xFF    // Never used as a sequence number
+#define FLASH_RUN_SIZE  64      // FLASH_RUN in the PRM file, flash_run() takes 63
+#define FLASH_PGM       0x01    // FLCR bits
+#define FLASH_ERASE     0x02
+#define FLASH_HVEN      0x08
+
+/* Defines the flash timings in passes of a DBNZA branching to itself, 3
+   bus cycles or 1.22us at 2.4576MHz, each rounded up past its minimum.
+   flash_run() is written in assembly so the cycles between the register
+   writes are fixed and counted alongside */
+#define FLASH_T_NVS     9       // 11.0us, 10us from PGM or ERASE to HVEN
+#define FLASH_T_PGS     5       // 6.1us, 5us from HVEN to the data
+#define FLASH_T_PROG    25      // 30us to 40us from the data to PGM off, 75+11 cycles or 35.0us
+#define FLASH_T_NVH     5       // 6.1us, 5us from PGM or ERASE off to HVEN off
+#define FLASH_T_RCV     1       // 1.2us, 1us before the array is read again
+#define FLASH_T_ERASE   13      // 4ms page erase, in passes of 772 cycles for 4.08ms
+
 /* Defines common bit masks */
 #define BIT0_MASK       1
 #define BIT1_MASK       2
@@ -111,28 +152,93 @@ volatile struct {
 #define ONE_DIGIT_MASK  4
 #define DAYS_MASK       0xFE
 #define FLASH_MASK      0x1F
+#define INPUT_MASK      0x0F
+#define MODE_SWITCH_MASK  0x10
+#define DEBUG_SWITCH_MASK 0x20
+#define ALARM_SWITCH_MASK 0x40
 
 /* Global data and constants*/
-#define HOUR            0
-#define MIN             1
-#define SEC             2
-#define DAY             3
-#define ALM_ENABLE      2
 #define BLANK           0xFF
-#define TIME_SIZE       4
-#define ALARM_COUNT     8
-#define ALARM_SIZE      3
+#define SCHEDULE_SIZE   16      // Alarm entries, count and entries fit one EEPROM page
+#define ALARM_SIZE      2       // Bytes per alarm entry in the EEPROM
+#define ALARM_ENABLE    0x8000  // Alarm enable bit above the minute of week
+#define ALARM_ONCE      0x4000  // One shot alarm, removed once it fires
+#define ALARM_TIME_MASK 0x3FFF
+#define SCHEDULE_STALE  ALARM_TIME_MASK  // Forces the cursor to be searched again
+#define SETTINGS_SIZE   1       // Snooze interval
+#define STORE_SIZE      (1 + ALARM_SIZE*SCHEDULE_SIZE + SETTINGS_SIZE)  // sizeof(struct store)
 #define INPUT_COUNT     10
 #define INPUT_SIZE      5
-#define BUFFER_SIZE     128
+#define CLOCK_TIME_SIZE 4       // Second, minute, hour and day registers
+#define CLOCK_SET_SIZE  7       // On through date and month to CLOCK_MODE_ADDR
 #define OUTPUT_SIZE     3
-
+#define LATCH_COUNT     5
+
+/* Time is kept as the minute of the week, 0 being Sunday 00:00, plus
+   the second. The hour, minute and day fields only exist at the edges,
+   when the RTC is read or written and when the display is rendered */
+#define MINUTES_PER_HOUR  60
+#define MINUTES_PER_DAY   1440
+#define MINUTES_PER_WEEK  10080
+#define HALF_DAY          720
+
+/* Tests a switch bit of the input sample */
+#define sampled(m)      ((sample & (m)) != 0)
+
+/* The data touched on every pass is placed in the zero page (Z_RAM in the
+   PRM file) where it is reached with shorter direct addressing and the
+   bit instructions. Everything else stays in DEFAULT_RAM */
+#pragma DATA_SEG __SHORT_SEG MY_ZEROPAGE
+#ifndef NO_DEBUG_CLOCK
 char debug;
-signed char time[TIME_SIZE], debug_time[TIME_SIZE];
-char alarms[ALARM_COUNT][ALARM_SIZE];
+#endif
+char sample;
+unsigned int time;
+char second;
+unsigned int snooze;
+char schedule_days;
 char output[OUTPUT_SIZE];
-char buttons[12][7];
-char buffer[BUFFER_SIZE];
+char buttons[INPUT_COUNT][INPUT_SIZE];
+#pragma DATA_SEG DEFAULT
+#ifndef NO_DEBUG_CLOCK
+unsigned int debug_time;
+char debug_second;
+#else
+#define debug           FALSE
+#endif
+
+/* The alarms are compiled from rules into a table of entries sorted by
+   minute of the week, each entry carrying its own enable and one shot
+   bits. schedule_next is the first entry at or after schedule_time.
+   The table and the settings are kept in the layout of their EEPROM
+   page, the 68HC08 being big endian like the page, so they are read and
+   written in place */
+struct store {
+  char count;
+  unsigned int entry[SCHEDULE_SIZE];
+  char snooze;                  // Snooze interval in minutes
+} store;
+#define schedule_count  store.count
+#define schedule        store.entry
+#define snooze_time     store.snooze
+char schedule_next;
+unsigned int schedule_time;
+#ifdef REPORTING
+char schedule_steps;
+#endif
+
+/* A user facing alarm rule, compiled into one entry per day it names */
+struct rule {
+  char days;                    // Bit n set for day n, SUN to SAT
+  unsigned int minute;          // Minute of the day
+  unsigned int flags;           // ALARM_ENABLE and ALARM_ONCE
+};
+
+/* Minute of the week each day starts at, indexed by the RTC day */
+const unsigned int day_start[8] = {
+  0, 0, 1*MINUTES_PER_DAY, 2*MINUTES_PER_DAY, 3*MINUTES_PER_DAY,
+  4*MINUTES_PER_DAY, 5*MINUTES_PER_DAY, 6*MINUTES_PER_DAY
+};
 
 /* State variables and constants */
 #define CLOCK_MODE      0
@@ -145,12 +251,62 @@ char buffer[BUFFER_SIZE];
 #define VIEW_ALARM      6
 #define ENABLE_ALARM    7
 #define ACTIVATE_ALARM  8
+#define CLOCK_MODES     9       // Values of mode[CLOCK_MODE]
 #define TIME_MODE       1
 #define NORMAL          0
 #define MILITARY        1
 #define ALARM_MODE      2
 #define BUZZER          TRUE
 #define IPOD            FALSE
+
+/* Key bindings. Each mode has a list of gestures, in the order they are
+   tried, ending in BIND_END. A release gesture fires on release after
+   start ticks held, a hold gesture after start ticks held and then every
+   repeat ticks, as in released() and held(). BIND_DAYS binds SUN to SAT,
+   the action getting the day pressed */
+#define BIND_RELEASE    0
+#define BIND_HOLD       1
+#define BIND_BEEP       2       // Beep when the gesture fires
+#define BIND_DAYS       0       // Any day button
+#define BIND_END        -1      // In the button field
+
+/* Key binding actions */
+#define ACT_PAUSE       0
+#define ACT_SKIP_BACK   1
+#define ACT_SKIP_FORWARD 2
+#define ACT_VOLUME_UP   3
+#define ACT_VOLUME_DOWN 4
+#define ACT_SET_CLOCK   5       // Into SET_CLOCK_HOUR
+#define ACT_VIEW_ALARM  6       // The day's alarm into VIEW_ALARM
+#define ACT_ENABLE_ALARM 7      // The day's alarm into ENABLE_ALARM
+#define ACT_SET_ALARM   8       // The day's alarm into SET_ALARM_HOUR
+#define ACT_HOUR_DOWN   9
+#define ACT_HOUR_UP     10
+#define ACT_HOURS_DOWN  11      // Half a day in 12 hour mode, an hour in 24
+#define ACT_HOURS_UP    12
+#define ACT_MIN_DOWN    13
+#define ACT_MIN_UP      14
+#define ACT_DAY_DOWN    15
+#define ACT_DAY_UP      16
+#define ACT_NEXT        17      // On to the next setting mode
+#define ACT_CLOCK_DONE  18      // Save the clock set, back to CLOCK
+#define ACT_ALARM_DONE  19      // Save the alarm set, back to CLOCK
+#define ACT_SNOOZE      20
+#define ACT_DISMISS     21
+
+/* The time and alarm modes, constant when the build leaves a choice out */
+#ifdef NO_12_HOUR
+#define time_mode       MILITARY
+#else
+#define time_mode       mode[TIME_MODE]
+#endif
+#if defined(NO_IPOD)
+#define alarm_mode      BUZZER
+#elif defined(NO_BUZZER)
+#define alarm_mode      IPOD
+#else
+#define alarm_mode      mode[ALARM_MODE]
+#endif
 #define NONE            0
 #define FLASH_SEC       1
 #define FLASH_MIN       2
@@ -159,15 +315,20 @@ char buffer[BUFFER_SIZE];
 #define FLASH_ALARM_DAY 16
 #define ALARM_ON        32
 #define FLASH_INTERVAL  5       // Flash interval in 1/20's of a second
-#define BUZZ_INTERVAL   5       // Buzz interval in 1/20's of a second
 #define VIEW_TIME       80      // View time in 1/20's of a second
-#define BEEP_TIME       2       // Beep time in 1/20's of a second
 #define OFF_TIME        80      // iPod off button hold time in 1/20's of a second
 #define DEBUG_SPEED     6       // 1/( 20 * Debug_Speed) = length of a second in debug mode 
+#define REPORT_INTERVAL 100     // Debug report interval in 1/20's of a second
+#define HEALTH_INTERVAL 1200    // Health save interval in 1/20's of a second
+#define TICK_MS         50      // Milliseconds per tick
+#define STUCK_TIME      6000    // Setting mode time without a press in 1/20's of a second
+#define TICK_MODULO     31250   // Timer 2 counts per 1/20 of a second
+#define DEBOUNCE_PERIOD 625     // Timer 2 counts per input sample, 1 millisecond
+#define DEBOUNCE_COUNT  5       // Samples an input must hold still to be accepted
 #define BEEP            TRUE
 #define NO_BEEP         FALSE
-#define SNOOZE          0
-#define SNOOZE_TIME     10      // Snooze interval in minutes
+#define SNOOZE_TIME     10      // Default snooze interval in minutes
+#define SNOOZE_MAX      60      // Longest snooze interval in minutes
 #define SUN             1
 #define MON             2
 #define TUE             3
@@ -175,6 +336,9 @@ char buffer[BUFFER_SIZE];
 #define THU             5
 #define FRI             6
 #define SAT             7
+#define WEEKDAYS        ((1<<MON) | (1<<TUE) | (1<<WED) | (1<<THU) | (1<<FRI))
+#define WEEKEND         ((1<<SUN) | (1<<SAT))
+#define EVERY_DAY       (WEEKDAYS | WEEKEND)
 #define DOWN            8
 #define SEL             9
 #define UP              10
@@ -194,48 +358,553 @@ char buffer[BUFFER_SIZE];
 #define NO_REPEAT       -1
 #define LOCK_BUTTON     -2
 
+#pragma DATA_SEG __SHORT_SEG MY_ZEROPAGE
 char mode[3];
 char control;
 char flash;
-char flash_ds;
-char beep;
-char beep_ds;
-char buzz;
-char buzz_ds;
+char buzz;                      // The alarm sound is playing
 char view;
-char view_ds;
 char off;
-char off_ds;
 char alarm_day;
-char clock_set;
 char i2c_timeout;
+#pragma DATA_SEG DEFAULT
+char flash_ds;
+char view_ds;
+char off_ds;
+char clock_set;
+
+/* Input debouncer state, kept by the Timer 2 channel 0 ISR */
+#pragma DATA_SEG __SHORT_SEG MY_ZEROPAGE
+volatile char debounced;        // Last input sample that held still
+char debounce_raw;              // Input sample being integrated
+char debounce_count;            // Samples debounce_raw has held still for
+volatile unsigned int msec;     // Milliseconds since boot, wraps
+#pragma DATA_SEG DEFAULT
+
+/* Sound channels, each owning one bit of an output bank */
+#define SOUND_BEEP      0
+#define SOUND_ALARM     1
+#define SOUND_COUNT     2
+#define SOUND_UNIT      10      // Milliseconds per pattern unit
+
+/* A sound pattern is a list of steps, each sounding for on units and
+   staying quiet for off units, count times over. A count of 0 repeats
+   the step until the pattern is stopped, an on of 0 ends the pattern */
+struct step {
+  char on;
+  char off;
+  char count;
+};
+
+/* The press feedback, a single 100 ms chirp */
+const struct step beep_pattern[] = {
+  {10, 0, 1},
+  {0, 0, 0}
+};
+
+/* A refused change, three quick chirps over the press feedback */
+const struct step full_pattern[] = {
+  {5, 5, 3},
+  {0, 0, 0}
+};
+
+/* The alarm, escalating from slow beeps to a near continuous tone */
+const struct step alarm_pattern[] = {
+  {25, 25, 20},                 // 250 ms beeps for 10 seconds
+  {10, 10, 50},                 // 100 ms beeps for 10 seconds
+  {40, 10, 0}                   // 400 ms beeps until dismissed
+};
+
+const char sound_addr[SOUND_COUNT] = { OUTPUT1_ADDR, OUTPUT2_ADDR };
+const char sound_mask[SOUND_COUNT] = { BEEP_MASK, ALARM_MASK };
+
+/* Sound engine state, stepped by the Timer 2 channel 0 ISR */
+#pragma DATA_SEG __SHORT_SEG MY_ZEROPAGE
+char sound_on;                  // Bit k set while channel k is sounding
+#pragma DATA_SEG DEFAULT
+const struct step *sound_step[SOUND_COUNT];
+char sound_count[SOUND_COUNT];  // Repeats left of the current step
+char sound_timer[SOUND_COUNT];  // Units left of the current half step
+char sound_div;                 // Milliseconds into the current unit
+
+/* Latency measurements. The press ones are taken from the first sample
+   of a new press, silence from the first sample of the release that
+   snoozes, and the alarm from the last clock reading before the minute
+   rolled over, so it is an upper bound */
+#define LATENCY_BEEP    0       // Press to the beep being started
+#define LATENCY_DISPLAY 1       // Press to the digits or day LEDs changing
+#define LATENCY_ALARM   2       // Minute rollover to the buzzer or the first iPod byte
+#define LATENCY_SILENCE 3       // Snooze release to the buzzer or iPod going quiet
+#define LATENCY_COUNT   4
+#define LATENCY_WINDOW  1000    // Milliseconds after which a measurement is given up on
+#define LATENCY_BUCKETS 8       // Buckets of <8, <16, ... <512, >=512 milliseconds
+
+#ifdef LATENCY
+#define LATENCY_MARK(k) latency_mark(k)
+#define LATENCY_BEGIN(k, t) latency_begin(k, t)
+
+unsigned int debounce_ms;       // msec at the first sample of debounce_raw
+unsigned int rollover_ms;       // msec at the last clock reading before second 0
+volatile unsigned int latency_start[LATENCY_COUNT];
+volatile char latency_pending;  // Measurements started and not yet taken
+unsigned int latency_last[LATENCY_COUNT];
+unsigned int latency_max[LATENCY_COUNT];
+unsigned int latency_hist[LATENCY_COUNT][LATENCY_BUCKETS];
+unsigned int latency_over[LATENCY_COUNT];  // Measurements over budget
+char latency_acted;             // A press has changed what the display shows
+
+/* Latency budgets in milliseconds */
+const unsigned int latency_budget[LATENCY_COUNT] = { 20, 60, 1000, 100 };
+
+/* Latch bits that show the outcome of a press, the colon changes on its
+   own. The digits and day LEDs blink in the setting modes too, so a
+   change only ends the measurement once the press has been acted on */
+const char latency_bits[LATCH_COUNT] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+#else
+#define LATENCY_MARK(k)
+#define LATENCY_BEGIN(k, t)
+#endif
+
+/* Host provisioning frames are FF 5A length command payload checksum, in
+   the iPod frame format. The length counts the command and payload, the
+   checksum makes everything after the header sum to zero. The image a
+   frame carries is the stored EEPROM page followed by the second and the
+   minute of the week, high byte first */
+#define HOST_HEADER     0x5A    // Second header byte, the iPod frames use 0x55
+#define HOST_READ       0x01    // Reply carries the image
+#define HOST_WRITE      0x02    // Carries the image, reply carries the status and time taken
+#define HOST_HEALTH     0x03    // Reply carries the health counters
+#define HOST_SNAPSHOT   0x04    // Carries an offset, reply carries a snapshot chunk
+#define HOST_RESTORE    0x05    // Carries a snapshot chunk, reply carries the status
+#define HOST_RULES      0x06    // Carries alarm rules, reply carries the status
+#define HOST_OK         0
+#define HOST_BAD_IMAGE  1       // Nothing was changed
+#define HOST_BUS_ERROR  2       // The I2C bus timed out committing
+#define HOST_IMAGE_SIZE (STORE_SIZE + 3)
+#define HOST_FRAME_SIZE (HOST_IMAGE_SIZE + 1)  // Command and payload
+#define HOST_IDLE       0       // Receiver states
+#define HOST_SYNC       1
+#define HOST_LENGTH     2
+#define HOST_BODY       3
+#define HOST_CHECKSUM   4
+#define HOST_TIMEOUT    1000    // Milliseconds to wait for the next restore chunk
+
+/* A rules frame replaces the schedule with up to 7 rules, each the days
+   mask and then the minute of the day and the flags, high byte first as
+   in struct rule. WEEKDAYS, WEEKEND and EVERY_DAY are the day groups */
+#define RULE_SIZE       5       // sizeof(struct rule)
+
+/* Snapshot chunks are the version, the snapshot size and the offset of
+   the chunk followed by up to SNAPSHOT_CHUNK bytes of the snapshot. The
+   snapshot is the main loop state listed in snapshot_fields, in order */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER 3
+#define SNAPSHOT_CHUNK  (HOST_FRAME_SIZE - 1 - SNAPSHOT_HEADER)
+
+/* Health counters, saturating and kept in the clock's battery backed RAM
+   so they survive resets and power loss. The check byte makes the saved
+   block sum to zero */
+#define HEALTH_CLOCK_TIMEOUT  0 // I2C timeouts talking to the clock
+#define HEALTH_EEPROM_TIMEOUT 1 // I2C timeouts talking to the EEPROM
+#define HEALTH_RETRY    2       // Clock reads retried after a timeout
+#define HEALTH_EEPROM_NAK 3     // EEPROM polls NAKed during a write cycle
+#define HEALTH_OVERRUN  4       // Ticks missed by a slow pass of the loop
+#define HEALTH_SCI_DROP 5       // Received bytes lost to an overrun or a busy frame
+#define HEALTH_ALARM    6       // Alarms fired
+#define HEALTH_SNOOZE   7       // Snoozes taken
+#define HEALTH_MISSED   8       // Alarms due in a minute whose first second was not seen
+#define HEALTH_STUCK    9       // Setting modes left without a press for STUCK_TIME
+#define HEALTH_INVARIANT 10     // Ticks that found the state out of range
+#define HEALTH_COUNT    11
+#define HEALTH_DATA_SIZE (2*HEALTH_COUNT + 2)
+#define HEALTH_SIZE     (HEALTH_DATA_SIZE + 1)  // sizeof(struct health)
+
+struct health {
+  unsigned int count[HEALTH_COUNT];
+  unsigned int line;            // Line of the last failed assert, 0 if none
+  char check;
+} health;
+char health_dirty;              // Changed since the last save
+char health_failing;            // An assert is saving the counters
+unsigned int health_ds;
+unsigned int health_ms;         // msec at the last tick
+unsigned int stuck_ds;          // Ticks in a setting mode without a press
+unsigned int alarm_seen;        // Minute alarm_check() last saw at second 0
+char i2c_device;                // Device of the transaction in progress
+
+#ifdef FLASH_STORE
+char flash_seq;                 // Sequence number of the newest record
+char *flash_last;               // Newest record, 0 if the log is empty
+char *flash_next;               // Free slot after it, 0 if its page is full
+#pragma DATA_SEG __SHORT_SEG MY_ZEROPAGE
+char flash_mode;                // FLASH_PGM or FLASH_ERASE for flash_run()
+char flash_data;                // Byte for flash_run() to program
+#pragma DATA_SEG DEFAULT
+
+/* Defined by the linker for the FLASH_ROUTINE segment holding flash_run() */
+extern char __SEG_START_FLASH_ROUTINE[];
+#endif
+
+#ifdef HOST
+char host_frame[HOST_FRAME_SIZE];
+char host_state;
+char host_length;
+char host_pos;
+char host_sum;
+unsigned int host_ms;           // msec at the first byte of the frame
+volatile char host_ready;       // A whole frame waits in host_frame
+
+/* The main loop state a snapshot holds. The sound and the debouncer
+   belong to the ISR and start over from the restored state, and the
+   switch modes are sampled again */
+struct field {
+  char *var;
+  char bytes;
+};
+const struct field snapshot_fields[] = {
+  { (char *)&time, sizeof(time) },
+  { &second, sizeof(second) },
+  { (char *)&snooze, sizeof(snooze) },
+  { &schedule_days, sizeof(schedule_days) },
+  { output, sizeof(output) },
+  { (char *)buttons, sizeof(buttons) },
+  { mode, sizeof(mode) },
+  { &control, sizeof(control) },
+  { &flash, sizeof(flash) },
+  { &view, sizeof(view) },
+  { &off, sizeof(off) },
+  { &alarm_day, sizeof(alarm_day) },
+  { &flash_ds, sizeof(flash_ds) },
+  { &view_ds, sizeof(view_ds) },
+  { &off_ds, sizeof(off_ds) },
+  { &clock_set, sizeof(clock_set) },
+  { (char *)&store, sizeof(store) },
+  { (char *)&alarm_seen, sizeof(alarm_seen) },
+  { (char *)&stuck_ds, sizeof(stuck_ds) },
+#ifndef NO_DEBUG_CLOCK
+  { (char *)&debug_time, sizeof(debug_time) },
+  { &debug_second, sizeof(debug_second) },
+#endif
+};
+#define SNAPSHOT_FIELDS (sizeof(snapshot_fields) / sizeof(snapshot_fields[0]))
+#endif
+
+/* Trace record tags, the high nibble holds the idle ticks before the record */
+#define TRACE_SAMPLE    1       // Followed by the input sample
+#define TRACE_TIME      2       // Followed by the RTC second and minute of week
+#define TRACE_SEC       4       // RTC second advanced by one
+#define TRACE_DISPLAY   8       // Followed by the latched display bytes, not a tick
+#define TRACE_IDLE_MAX  15
+
+#ifdef TICK_LOCKED
+unsigned int rtc_time;
+char rtc_second;
+#endif
+#if defined(TICK_LOCKED) || defined(LATENCY)
+char shown[LATCH_COUNT];
+char shown_changed;
+#endif
+#ifdef TRACE
+unsigned int trace_time;
+char trace_second;
+char trace_sample;
+char trace_idle;
+#endif
+#ifdef REPLAY
+char replay_tag;
+char replay_wait;
+#endif
+
+/* Profiler phases and constants */
+#define PROF_BUTTONS    0
+#define PROF_TICK       1
+#define PROF_SCAN       2
+#define PROF_MODE       3
+#define PROF_TIME_READ  4
+#define PROF_FLUSH      5
+#define PROF_I2C        6
+#define PROF_FLASH      7
+#define PROF_COUNT      8
+#define PROF_BUCKETS    6       // Buckets of <256, <1K, <4K, <16K, <64K, >=64K bus cycles
+
+#ifdef PROFILE
+/* Timestamps a phase with the Timer 2 counter, 1 count = 4 bus cycles */
+#define PROF_BEGIN(p)   prof_start[p] = T2CNT
+#define PROF_END(p)     prof_record(p)
+
+unsigned int prof_start[PROF_COUNT];
+unsigned int prof_max[PROF_COUNT];
+unsigned int prof_hist[PROF_COUNT][PROF_BUCKETS];
+#else
+#define PROF_BEGIN(p)
+#define PROF_END(p)
+#endif
+
+/* Stack check constants */
+#define STACK_PAINT     0xA5    // Sentinel for stack bytes that were never used
+#define STACK_MARGIN    4       // Bytes below the painter's frame left alone
+
+#ifdef STACK_CHECK
+/* Defined by the linker for the STACKSIZE area in the PRM file */
+extern char __SEG_START_SSTACK[];
+extern char __SEG_END_SSTACK[];
+extern char __SEG_SIZE_SSTACK[];
+extern char __SEG_SIZE_DEFAULT_RAM[];
+#define RAM_SIZE        0x0160  // RAM in the PRM file, 0x0100 to 0x025F
+#endif
+
+#ifdef REPORTING
+char report_ds;
+char report_busy;               // The report is being written, its own traffic is not counted
+#endif
+
+/* Bus event log, the last BUS_LOG_SIZE latch strobes, SCI bytes and I2C
+   transactions stamped with the low byte of msec and the Timer 2 count,
+   for lining up against each other in a waveform viewer */
+#define BUS_LOG_SIZE    16      // Power of two
+#define BUS_LATCH       0x10    // Low nibble is the latch address, value the data
+#define BUS_SCI         0x20    // Value is the byte sent
+#define BUS_I2C_START   0x30    // Value is the device address, read bit included
+#define BUS_I2C_STOP    0x40    // Value is the timeout flag
+
+/* Energy model, charges in uA ms. The figures are estimates to be
+   replaced with measurements of the board */
+#define ENERGY_I2C      0       // Activities counted
+#define ENERGY_SCI      1
+#define ENERGY_LATCH    2
+#define ENERGY_SOUND    3       // SOUND_UNIT milliseconds sounding
+#define ENERGY_KINDS    4
+#define ENERGY_MODES    CLOCK_MODES
+#define ENERGY_TICK_MAX 2000    // Ticks counted per mode between reports, fits the worst charge in 32 bits
+#define CPU_UA          7000    // MCU running flat out, the loop never sleeps
+#define SOUND_UA        30000   // Buzzer or beeper sounding
+#define CHARGE_I2C      150     // Per transaction
+#define CHARGE_SCI      500     // Per byte, 0.52ms on the line
+#define CHARGE_LATCH    2       // Per display latch strobe
+#define BATTERY_MAH     2000    // Battery carrying the clock through an outage
+
+#ifdef ENERGY
+unsigned int energy_ticks[ENERGY_MODES];
+unsigned long energy_charge[ENERGY_MODES];
+unsigned int energy_count[ENERGY_KINDS];
+volatile unsigned int energy_sound;  // Sound units since the last tick, counted by the ISR
+#define ENERGY_ADD(k, q) if (!report_busy) energy_add(k, q)
+#else
+#define ENERGY_ADD(k, q)
+#endif
+
+#ifdef BUS_LOG
+struct bus_event {
+  char ms;
+  unsigned int count;
+  char kind;
+  char value;
+} bus_events[BUS_LOG_SIZE];
+char bus_head;                  // Slot for the next event
+char bus_count;                 // Events in the log
+#define BUS_EVENT(k, v) bus_log(k, v)   // Interrupts already off
+#define BUS_EVENT_MAIN(k, v) { DisableInterrupts; bus_log(k, v); EnableInterrupts; }
+#else
+#define BUS_EVENT(k, v)
+#define BUS_EVENT_MAIN(k, v)
+#endif
+
+/* Key binding tables, see BIND_RELEASE */
+struct binding {
+  signed char button;
+  char gesture;
+  signed char start;
+  signed char repeat;
+  char action;
+};
+const struct binding clock_bindings[] = {
+  { SEL,       BIND_RELEASE,            0,        0,           ACT_PAUSE },
+  { DOWN,      BIND_RELEASE,            0,        0,           ACT_SKIP_BACK },
+  { UP,        BIND_RELEASE,            0,        0,           ACT_SKIP_FORWARD },
+  { SEL,       BIND_HOLD | BIND_BEEP,   20,       LOCK_BUTTON, ACT_SET_CLOCK },
+  { UP,        BIND_HOLD,               10,       4,           ACT_VOLUME_UP },
+  { DOWN,      BIND_HOLD,               10,       4,           ACT_VOLUME_DOWN },
+  { BIND_DAYS, BIND_RELEASE,            0,        0,           ACT_VIEW_ALARM },
+  { BIND_DAYS, BIND_HOLD | BIND_BEEP,   10,       NO_REPEAT,   ACT_ENABLE_ALARM },
+  { BIND_DAYS, BIND_HOLD | BIND_BEEP,   NO_START, 20,          ACT_SET_ALARM },
+  { BIND_END }
+};
+const struct binding set_clock_hour_bindings[] = {
+  { DOWN,      BIND_RELEASE,            0,        0,           ACT_HOUR_DOWN },
+  { DOWN,      BIND_HOLD,               20,       20,          ACT_HOURS_DOWN },
+  { UP,        BIND_RELEASE,            0,        0,           ACT_HOUR_UP },
+  { UP,        BIND_HOLD,               20,       20,          ACT_HOURS_UP },
+  { SEL,       BIND_HOLD | BIND_BEEP,   0,        LOCK_BUTTON, ACT_NEXT },
+  { BIND_END }
+};
+const struct binding set_clock_min_bindings[] = {
+  { DOWN,      BIND_RELEASE,            0,        0,           ACT_MIN_DOWN },
+  { DOWN,      BIND_HOLD,               10,       2,           ACT_MIN_DOWN },
+  { UP,        BIND_RELEASE,            0,        0,           ACT_MIN_UP },
+  { UP,        BIND_HOLD,               10,       2,           ACT_MIN_UP },
+  { SEL,       BIND_HOLD | BIND_BEEP,   0,        LOCK_BUTTON, ACT_NEXT },
+  { BIND_END }
+};
+const struct binding set_day_bindings[] = {
+  { DOWN,      BIND_RELEASE,            0,        0,           ACT_DAY_DOWN },
+  { DOWN,      BIND_HOLD,               10,       10,          ACT_DAY_DOWN },
+  { UP,        BIND_RELEASE,            0,        0,           ACT_DAY_UP },
+  { UP,        BIND_HOLD,               10,       10,          ACT_DAY_UP },
+  { SEL,       BIND_HOLD | BIND_BEEP,   0,        LOCK_BUTTON, ACT_CLOCK_DONE },
+  { BIND_END }
+};
+const struct binding set_alarm_hour_bindings[] = {
+  { DOWN,      BIND_RELEASE,            0,        0,           ACT_HOUR_DOWN },
+  { DOWN,      BIND_HOLD,               10,       20,          ACT_HOURS_DOWN },
+  { UP,        BIND_RELEASE,            0,        0,           ACT_HOUR_UP },
+  { UP,        BIND_HOLD,               10,       20,          ACT_HOURS_UP },
+  { SEL,       BIND_HOLD | BIND_BEEP,   0,        LOCK_BUTTON, ACT_NEXT },
+  { BIND_END }
+};
+const struct binding set_alarm_min_bindings[] = {
+  { DOWN,      BIND_RELEASE,            0,        0,           ACT_MIN_DOWN },
+  { DOWN,      BIND_HOLD,               10,       2,           ACT_MIN_DOWN },
+  { UP,        BIND_RELEASE,            0,        0,           ACT_MIN_UP },
+  { UP,        BIND_HOLD,               10,       2,           ACT_MIN_UP },
+  { SEL,       BIND_HOLD | BIND_BEEP,   0,        LOCK_BUTTON, ACT_ALARM_DONE },
+  { BIND_END }
+};
+const struct binding view_alarm_bindings[] = {
+  { SEL,       BIND_HOLD | BIND_BEEP,   20,       LOCK_BUTTON, ACT_SET_CLOCK },
+  { UP,        BIND_HOLD,               0,        LOCK_BUTTON, ACT_VOLUME_UP },
+  { DOWN,      BIND_HOLD,               0,        LOCK_BUTTON, ACT_VOLUME_DOWN },
+  { BIND_DAYS, BIND_RELEASE,            0,        0,           ACT_VIEW_ALARM },
+  { BIND_DAYS, BIND_HOLD | BIND_BEEP,   10,       NO_REPEAT,   ACT_ENABLE_ALARM },
+  { BIND_DAYS, BIND_HOLD | BIND_BEEP,   NO_START, 20,          ACT_SET_ALARM },
+  { BIND_END }
+};
+const struct binding activate_alarm_bindings[] = {
+  { DOWN,      BIND_RELEASE,            0,        0,           ACT_SNOOZE },
+  { SEL,       BIND_RELEASE,            0,        0,           ACT_SNOOZE },
+  { UP,        BIND_RELEASE,            0,        0,           ACT_SNOOZE },
+  { DOWN,      BIND_HOLD,               20,       LOCK_BUTTON, ACT_DISMISS },
+  { SEL,       BIND_HOLD,               20,       LOCK_BUTTON, ACT_DISMISS },
+  { UP,        BIND_HOLD,               20,       LOCK_BUTTON, ACT_DISMISS },
+  { BIND_END }
+};
+const struct binding *const mode_bindings[CLOCK_MODES] = {
+  clock_bindings,               // CLOCK
+  set_clock_hour_bindings,      // SET_CLOCK_HOUR
+  set_clock_min_bindings,       // SET_CLOCK_MIN
+  set_day_bindings,             // SET_DAY
+  set_alarm_hour_bindings,      // SET_ALARM_HOUR
+  set_alarm_min_bindings,       // SET_ALARM_MIN
+  view_alarm_bindings,          // VIEW_ALARM
+  0,                            // ENABLE_ALARM
+  activate_alarm_bindings       // ACTIVATE_ALARM
+};
+
+/* What flashes in each setting mode, SET_CLOCK_HOUR to SET_ALARM_MIN */
+const char setting_control[VIEW_ALARM] = {
+  NONE,
+  FLASH_HOUR,
+  FLASH_MIN,
+  FLASH_DAY,
+  FLASH_HOUR | FLASH_ALARM_DAY,
+  FLASH_MIN | FLASH_ALARM_DAY
+};
 
 /* Initialize function prototypes */
 void init(void);
+void state_load(void);
+void loop(void);
 
 /* I/O function prototypes */
 void flush(void);
+void latch(char, char);
 void scan(void);;
 char released(char, signed char, char);
 char held(char, signed char, signed char, char);
+void bind_match(void);
+char bind_fire(const struct binding *, char);
+void bind_do(char, char);
 
 /* Helper function prototpes */
 char bcd2dec(char);
 char dec2bcd(char);
 char sn(char);
+void fail(unsigned int);
+
+/* Health function prototypes */
+void health_count(char);
+void health_load(void);
+void health_save(void);
+void health_check(void);
+char state_valid(void);
+void alarm_missed(void);
+void health_report(void);
+
+/* Energy model function prototypes */
+void energy_add(char, unsigned int);
+void energy_tick(void);
+void energy_report(void);
+void energy_line(unsigned int, unsigned long);
+
+/* Bus event log function prototypes */
+void bus_log(char, char);
+void bus_report(void);
+
+/* EEPROM function prototypes */
+char eeprom_wait(void);
+void store_check(void);
+
+/* Flash log function prototypes */
+char *flash_scan(void);
+void flash_append(void);
+char flash_sum(const char *);
+void flash_write(char *, const char *, char);
+void flash_erase(char *);
+void flash_call(char *, const char *, char);
+void flash_run(char *);
 
 /* Alarm function prototypes */
-void alarm_write(void);
-void alarm_read(void);
+void alarm_load(char);
+char alarm_set(char, unsigned int);
+char alarm_toggle(char);
+
+/* Schedule function prototypes */
+char schedule_find(unsigned int);
+char schedule_first(char);
+char schedule_insert(unsigned int);
+void schedule_remove(char);
+char schedule_add(const struct rule *);
+char schedule_compile(const struct rule *, char);
+void store_image(char *);
+char store_valid(const char *);
+char store_load(const char *);
+void schedule_update(void);
+void schedule_sync(void);
+void schedule_write(void);
+void schedule_read(void);
 char alarm_check(void);
 
 /* Time function prototypes */
 void time_write(void);
+void time_write_set(void);
+void time_fill(char *);
 void time_read(void);
+unsigned int rtc_read(char *);
 char time_format(char);
+unsigned int time_add(unsigned int, int, unsigned int);
+char time_day(unsigned int);
+unsigned int time_of_day(unsigned int);
 void time_volatile(char);
 
-/* iPod function prototypes */
+/* iPod function prototypes, calls compile away in builds without the iPod */
+#ifdef NO_IPOD
+#define ipod_play()
+#define ipod_pause()
+#define ipod_off()
+#define ipod_skip_forward()
+#define ipod_skip_back()
+#define ipod_volume_up()
+#define ipod_volume_down()
+#else
 void ipod_play(void);
 void ipod_pause(void);
 void ipod_off(void);
@@ -252,18 +921,68 @@ void ipod_cmd_volume_down(void);
 void ipod_cmd_stop(void);
 void ipod_cmd_off(void);
 void ipod_cmd_button_release(void);
+#endif
 
 /* SCI bus function prototypes */
 void sci_write(unsigned char);
+unsigned char sci_read(void);
+void sci_print(const char *);
+void sci_dec(unsigned int);
+
+/* Benchmark function prototypes */
+void bench(void);
+void bench_report(const char *, unsigned long, unsigned int);
+unsigned long wcet_bound(char);
+unsigned long wcet_pass(char);
+void wcet_report(void);
+
+/* Trace function prototypes */
+void trace_tick(void);
+void trace_display(void);
+void replay_tick(void);
+char replay_read_tag(void);
+
+/* Profiler function prototypes */
+void prof_record(char);
+void prof_report(void);
+
+/* Timer 2 channel 0 function prototypes */
+void ms_tick(void);
+void debounce(void);
+void sound_start(char, const struct step *);
+void sound_stop(char);
+void sound_tick(void);
+void sound_latch(char);
+char sound_bits(char);
+void latency_mark(char);
+void latency_begin(char, unsigned int);
+void latency_report(void);
+unsigned int latency_percentile(char, char);
+
+/* Host function prototypes */
+void host_rx(void);
+void host_command(void);
+void host_reply(char, char);
+char host_restore(void);
+char host_rules(const struct rule *, char);
+char snapshot_size(void);
+void snapshot_copy(char *, char, char, char);
+
+/* Debug report function prototypes */
+void report(void);
+void schedule_report(void);
+void stack_paint(void);
+void stack_report(void);
 
 /* I2C bus function prototypes */
-void i2c_write(char, char *, char);
+void i2c_write(char, char *, char, char *, char);
 void i2c_read(char, char *, char);
 void i2c_start_timeout(void);
 
 void main(void) {  
-  char i;
- 
+#ifdef STACK_CHECK
+  stack_paint();                // Paint the unused stack before anything runs
+#endif
   EnableInterrupts;             // Enable interrupts
   CONFIG1_COPD = 1;             // Disable COP reset
  
@@ -274,6 +993,12 @@ void main(void) {
   SCBR_SCP = 0;                 // Baud rate prescaler = 1
   SCBR_SCR = 1;                 // Baud rate divisor = 2
   SCC2_TE = 1;                  // Enable transmitter
+#ifdef REPLAY
+  SCC2_RE = 1;                  // Enable receiver for the trace
+#elif defined(HOST)
+  SCC2_RE = 1;                  // Enable receiver for host frames
+  SCC2_SCRIE = 1;               // Interrupt on each received byte
+#endif
     
   /* Configure I2C */
   CONFIG2_IICSEL = 1;           // Set PTA bits 2-3 for I2C
@@ -292,381 +1017,276 @@ void main(void) {
  
   /* Initialize the clock */
   init();
-    
+  
+#ifdef BENCHMARK
+  /* Measure the hot functions before the clock starts */
+  bench();
+#endif
+
   /* Configure Timer 2 */
   T2SC_TRST = 1;                // Reset timer
   T2SC_PS = 2;                  // Set prescalar for divide by 4
   T2SC_TOIE = 0;                // Disable timer interrupt
-  T2MOD = 31250;                // Store modulo value in T1MODH:T1MODL
+  T2MOD = TICK_MODULO;          // Store modulo value in T1MODH:T1MODL
+  T2CH0 = DEBOUNCE_PERIOD;      // First input sample a millisecond in
+  T2SC0_MS0A = 1;               // Output compare, pin left to the port
+  T2SC0_CH0IE = 1;              // Enable channel interrupt
   T2SC_TSTOP = 0;               // Start timer running
      
-  for(;;) {  
-    /* Update status of buttons */
-    for (i=0; i<INPUT_COUNT; i++) {
-      buttons[i][STATUS]=RELEASED;
-    }
-    if (input>0 && input<=INPUT_COUNT) {
-      buttons[input-1][STATUS]=PRESSED;
-    }
-    
-    /* Are we debugging? */
-    if (debug != debug_switch) {
-      debug = debug_switch;
-      time_write();
+  for(;;) loop();
+}
+
+/* Runs one pass of the main loop */
+void loop(void) {
+  char i;
+  unsigned int t;
+  
+#ifdef HOST
+  /* Serve a host frame */
+  if (host_ready) host_command();
+#endif
+
+  /* Sample the inputs */
+#ifdef TRACE
+  while (!tick_expired) {}      // Wait for the tick
+  trace_tick();
+#elif defined(REPLAY)
+  replay_tick();
+#else
+  sample = debounced;
+#endif
+  
+  /* Update status of buttons */
+  PROF_BEGIN(PROF_BUTTONS);
+  for (i=0; i<INPUT_COUNT; i++) {
+    buttons[i][STATUS]=RELEASED;
+  }
+  i = sample & INPUT_MASK;
+  if (i>0 && i<=INPUT_COUNT) {
+    buttons[i-1][STATUS]=PRESSED;
+  }
+  PROF_END(PROF_BUTTONS);
+  
+#ifndef NO_DEBUG_CLOCK
+  /* Are we debugging? */
+  if (debug != sampled(DEBUG_SWITCH_MASK)) {
+    debug = sampled(DEBUG_SWITCH_MASK);
+    time_write();
+  }
+#endif
+
+#ifndef NO_12_HOUR
+  /* Are we in 12/24 mode? */
+  if (mode[TIME_MODE] != sampled(MODE_SWITCH_MASK)) {
+    mode[TIME_MODE] = sampled(MODE_SWITCH_MASK);
+  }
+#endif
+  
+#if !defined(NO_BUZZER) && !defined(NO_IPOD)
+  /* Are we in buzzer or iPod mode? */
+  if (mode[ALARM_MODE] != sampled(ALARM_SWITCH_MASK)) {
+    mode[ALARM_MODE] = sampled(ALARM_SWITCH_MASK);
+  }
+#endif
+            
+  /* Did Timer 2 expire? */
+  if (tick_expired) {
+    T2SC_TOF = 0;             // Reenable timer
+    PROF_BEGIN(PROF_TICK);
+    DisableInterrupts;
+    t = msec - health_ms;
+    health_ms = msec;
+    EnableInterrupts;
+    if (t >= 2*TICK_MS) health_count(HEALTH_OVERRUN);
+    health_check();
+#ifdef ENERGY
+    energy_tick();
+#endif
+    if (health_ds++ % HEALTH_INTERVAL == 0) {
+      health_ds=1;
+      if (health_dirty) health_save();
     }
- 
-    /* Are we in 12/24 mode? */
-    if (mode[TIME_MODE] != mode_switch) {
-      mode[TIME_MODE] = mode_switch;
+    if (!(control & FLASH_MASK)) {
+      flash=TRUE;
+      flash_ds=1;
+    } else if (flash_ds++ % FLASH_INTERVAL == 0) {
+      flash=!flash;
+      flash_ds=1;
     }
-    
-    /* Are we in buzzer or iPod mode? */
-    if (mode[ALARM_MODE] != alarm_switch) {
-      mode[ALARM_MODE] = alarm_switch;
+    if (!view) view_ds=1;
+    else if (view_ds++ % VIEW_TIME == 0) {
+      view=FALSE;
+      view_ds=1;
     }
-              
-    /* Did Timer 2 expire? */
-    if (T2SC_TOF == 1) {
-      T2SC_TOF = 0;             // Reenable timer
-      if (!(control & FLASH_MASK)) {
-        flash=TRUE;
-        flash_ds=1;
-      } else if (flash_ds++ % FLASH_INTERVAL == 0) {
-        flash=!flash;
-        flash_ds=1;
-      }
-      if (!(control & ALARM_ON)) {
-        buzz=TRUE;
-        buzz_ds=1;
-      } else if (buzz_ds++ % BUZZ_INTERVAL == 0) {
-        buzz=!buzz;
-        buzz_ds=1;
-      }
-      if (!view) view_ds=1;
-      else if (view_ds++ % VIEW_TIME == 0) {
-        view=FALSE;
-        view_ds=1;
-      }
-      if (!beep) beep_ds=1;
-      else if (beep_ds++ % BEEP_TIME == 0) {
-        beep=FALSE;
-        beep_ds=1;
-      }
-      if (!off) off_ds=1;
-      else if (off_ds++ % OFF_TIME == 0) {
-        off=FALSE;
-        off_ds=1;
-        ipod_cmd_button_release();
-      }
-      
-      /* Debug clock? */
-      if (debug) {
-        /* Speed up time for debugging */
-        debug_time[SEC]+=DEBUG_SPEED;
-        if (debug_time[SEC]>59) {
-          debug_time[SEC]=0;
-          debug_time[MIN]++;
-        }
-        if (debug_time[MIN]>59) {
-          debug_time[MIN]=0;
-          debug_time[HOUR]++;
-        }
-        if (debug_time[HOUR]>23) {
-          debug_time[HOUR]=0;
-          debug_time[DAY]++;
-        }
-        if (debug_time[DAY]>7) {
-          debug_time[DAY]=1;
-        }
-      }
- 
-      scan();                   // Scan inputs
+#ifndef NO_IPOD
+    if (!off) off_ds=1;
+    else if (off_ds++ % OFF_TIME == 0) {
+      off=FALSE;
+      off_ds=1;
+      ipod_cmd_button_release();
     }
-      
-    /* CLOCK mode */  
-    if (mode[CLOCK_MODE] == CLOCK) {
-      control = NONE;
+#endif
     
-      if (clock_set == FALSE) control = FLASH_HOUR | FLASH_MIN;
-      
-      /* Update time */
-      time_read();
-      
-      /* Change mode? */
-      if (alarm_check()) {
-        mode[CLOCK_MODE] = ACTIVATE_ALARM;
-        if (mode[ALARM_MODE]==IPOD) {
-          ipod_play();
-        }
-      } else if (released(SEL, 0, NO_BEEP)) {
-        ipod_pause();
-      } else if (released(DOWN, 0, NO_BEEP)) {
-        ipod_skip_back();
-      } else if (released(UP, 0, NO_BEEP)) {
-        ipod_skip_forward(); 
-      } else if (held(SEL, 20, LOCK_BUTTON, BEEP)) {
-        time_read();
-        mode[CLOCK_MODE] = SET_CLOCK_HOUR;
-        time_volatile(FALSE);
-      } else if (held(UP, 10, 4, NO_BEEP)) {    
-        ipod_volume_up();
-      } else if (held(DOWN, 10, 4, NO_BEEP)) {    
-        ipod_volume_down();
-      } else {  
-        for (i=SUN; i<=SAT; i++) {
-          if (released(i, 0, NO_BEEP)) {
-            alarm_day = i;
-            view = TRUE;
-            mode[CLOCK_MODE] = VIEW_ALARM;
-          }
-          else if (held(i, 10, NO_REPEAT, BEEP)) {
-            alarm_day = i;
-            mode[CLOCK_MODE] = ENABLE_ALARM;
-          } else if (held(i, NO_START, 20, BEEP)) {
-            alarm_day = i;
-              
-            /* Load alarm to set */
-            time[HOUR]= alarms[alarm_day][HOUR];
-            time[MIN] = alarms[alarm_day][MIN];
-            
-            mode[CLOCK_MODE] = SET_ALARM_HOUR;
-          }
-        }
+#ifndef NO_DEBUG_CLOCK
+    /* Debug clock? */
+    if (debug) {
+      /* Speed up time for debugging */
+      debug_second+=DEBUG_SPEED;
+      if (debug_second>59) {
+        debug_second=0;
+        if (++debug_time>=MINUTES_PER_WEEK) debug_time=0;
       }
-    }    
-      
-    /* SET_CLOCK_HOUR mode */
-    else if (mode[CLOCK_MODE] == SET_CLOCK_HOUR) {
-      control = FLASH_HOUR;
-      
-      /* Decrease hour? */
-      if (released(DOWN, 0, NO_BEEP)) time[HOUR]--;
-      else if (held(DOWN, 20, 20, NO_BEEP)) {
-        if (mode[TIME_MODE] == NORMAL) time[HOUR]-=12;
-        else time[HOUR]--;
-      }
-      if (time[HOUR]<0) time[HOUR]+=24;
-      
-      /* Increase hour? */
-      if (released(UP, 0, NO_BEEP)) time[HOUR]++;
-      else if (held(UP, 20, 20, NO_BEEP)) {
-        if (mode[TIME_MODE] == NORMAL) time[HOUR]+=12;
-        else time[HOUR]++;
-      }
-      if (time[HOUR]>23) time[HOUR]-=24;
-      
-      /* Change mode? */
-      if (held(SEL, 0, LOCK_BUTTON, BEEP)) mode[CLOCK_MODE]=SET_CLOCK_MIN;
     }
-      
-    /* SET_CLOCK_MIN mode */
-    else if (mode[CLOCK_MODE] == SET_CLOCK_MIN) {
-      control = FLASH_MIN;
-       
-      /* Decrease minute? */
-      if (released(DOWN, 0, NO_BEEP)) time[MIN]--;
-      else if (held(DOWN, 10, 2, NO_BEEP)) time[MIN]--;     
-      if (time[MIN]<0) time[MIN]+=60;
-      
-      /* Increase minute? */
-      if (released(UP, 0, NO_BEEP)) time[MIN]++;
-      else if (held(UP, 10, 2, NO_BEEP)) time[MIN]++;     
-      if (time[MIN]>59) time[MIN]-=60;
-        
-      /* Change mode? */
-      if (held(SEL, 0, LOCK_BUTTON, BEEP)) mode[CLOCK_MODE]=SET_DAY;
-    }
-            
-    /* SET_DAY mode */
-    else if (mode[CLOCK_MODE] == SET_DAY) {
-      control = FLASH_DAY;
-      
-      /* Decrease day? */
-      if(released(DOWN, 0, NO_BEEP)) time[DAY]--;
-      else if (held(DOWN, 10, 10, NO_BEEP)) time[DAY]--;
-      if (time[DAY]<1) time[DAY]+=7;
-      
-      /* Increase day? */
-      if(released(UP, 0, NO_BEEP)) time[DAY]++;
-      else if (held(UP, 10, 10, NO_BEEP)) time[DAY]++;
-      if (time[DAY]>7) time[DAY]-=7;
-       
-      /* Change mode? */
-      if (held(SEL, 0, LOCK_BUTTON, BEEP)) {
-        mode[CLOCK_MODE]=CLOCK;
-        time[SEC] = 0;
-        time_write();
-        time_volatile(TRUE);
-      }
+#endif
+
+    PROF_BEGIN(PROF_SCAN);
+    scan();                   // Scan inputs
+    PROF_END(PROF_SCAN);
+    PROF_END(PROF_TICK);
+
+#ifdef REPORTING
+    /* Time to report? */
+    if (!sampled(DEBUG_SWITCH_MASK)) report_ds=1;
+    else if (report_ds++ % REPORT_INTERVAL == 0) {
+      report_ds=1;
+      report();
     }
+#endif
+  }
     
-    /* SET_ALARM_HOUR mode */
-    else if (mode[CLOCK_MODE] == SET_ALARM_HOUR) {
-      control = FLASH_HOUR | FLASH_ALARM_DAY;
-      
-      /* Decrease hour? */
-      if (released(DOWN, 0, NO_BEEP)) time[HOUR]--;
-      else if (held(DOWN, 10, 20, NO_BEEP)) {
-        if (mode[TIME_MODE] == NORMAL) time[HOUR]-=12;
-        else time[HOUR]--;
-      }
-      if (time[HOUR]<0) time[HOUR]+=24;
-      
-      /* Increase hour? */
-      if (released(UP, 0, NO_BEEP)) time[HOUR]++;
-      else if (held(UP, 10, 20, NO_BEEP)) {
-        if (mode[TIME_MODE] == NORMAL) time[HOUR]+=12;
-        else time[HOUR]++;
-      }
-      if (time[HOUR]>23) time[HOUR]-=24;
-      
-      /* Change mode? */
-      if (held(SEL, 0, LOCK_BUTTON, BEEP)) mode[CLOCK_MODE]=SET_ALARM_MIN;
-    }
+  PROF_BEGIN(PROF_MODE);
+  
+  /* CLOCK mode */  
+  if (mode[CLOCK_MODE] == CLOCK) {
+    control = NONE;
+  
+    if (clock_set == FALSE) control = FLASH_HOUR | FLASH_MIN;
     
-    /* SET_ALARM_MIN mode */
-    else if (mode[CLOCK_MODE] == SET_ALARM_MIN) {
-      control = FLASH_MIN | FLASH_ALARM_DAY;
-       
-      /* Decrease minute? */
-      if (released(DOWN, 0, NO_BEEP)) time[MIN]--;
-      else if (held(DOWN, 10, 2, NO_BEEP)) time[MIN]--;     
-      if (time[MIN]<0) time[MIN]+=60;
-      
-      /* Increase minute? */
-      if (released(UP, 0, NO_BEEP)) time[MIN]++;
-      else if (held(UP, 10, 2, NO_BEEP)) time[MIN]++;     
-      if (time[MIN]>59) time[MIN]-=60;
-        
-      /* Change mode? */
-      if (held(SEL, 0, LOCK_BUTTON, BEEP)) {
-        mode[CLOCK_MODE]=CLOCK;
-      
-        /* Enable and save the alarm */
-        alarms[alarm_day][HOUR]=time[HOUR];
-        alarms[alarm_day][MIN]=time[MIN];
-        alarms[alarm_day][ALM_ENABLE] = TRUE;
-        alarm_write();
-        alarm_day = NONE;
-      }
-    }
-        
-    /* VIEW_ALARM mode */
-    else if (mode[CLOCK_MODE] == VIEW_ALARM) {
-      control = FLASH_ALARM_DAY;
-      
-      /* Update time */
-      time_read();
-      
-      /* Change mode? */
-      if (alarm_check()) {
-        mode[CLOCK_MODE] = ACTIVATE_ALARM;
-        if (mode[ALARM_MODE]==IPOD) {
-          ipod_play();
-        }
-      } else if (held(SEL, 20, LOCK_BUTTON, BEEP)) {
-        time_read();
-        mode[CLOCK_MODE] = SET_CLOCK_HOUR;
-        time_volatile(FALSE);
-      } else if (held(UP, 0, LOCK_BUTTON, NO_BEEP)) {    
-        ipod_volume_up();
-      } else if (held(DOWN, 0, LOCK_BUTTON, NO_BEEP)) {    
-        ipod_volume_down();
-      } else {  
-        for (i=SUN; i<=SAT; i++) {
-          if (released(i, 0, NO_BEEP)) {
-            alarm_day = i;
-            view = TRUE;
-            view_ds=1;
-            mode[CLOCK_MODE] = VIEW_ALARM;
-          }
-          else if (held(i, 10, NO_REPEAT, BEEP)) {
-            alarm_day = i;
-            mode[CLOCK_MODE] = ENABLE_ALARM;
-          } else if (held(i, NO_START, 20, BEEP)) {
-            alarm_day = i;
-              
-            /* Load alarm to set */
-            time[HOUR]= alarms[alarm_day][HOUR];
-            time[MIN] = alarms[alarm_day][MIN];
-            
-            mode[CLOCK_MODE] = SET_ALARM_HOUR;
-          }
-        }
-      }
-      
-      /* Did the view time expire? */
-      if (view == FALSE) {
-        alarm_day = NONE;
-        mode[CLOCK_MODE]=CLOCK;
+    /* Update time */
+    time_read();
+    
+    /* Change mode? */
+    if (alarm_check()) {
+      health_count(HEALTH_ALARM);
+      LATENCY_BEGIN(LATENCY_ALARM, rollover_ms);
+      mode[CLOCK_MODE] = ACTIVATE_ALARM;
+      if (alarm_mode==IPOD) {
+        ipod_play();
       }
+    } else bind_match();
+  }    
+    
+  /* Setting modes */
+  else if (mode[CLOCK_MODE] < VIEW_ALARM) {
+    control = setting_control[mode[CLOCK_MODE]];
+    bind_match();
+  }
       
-      /* Load alarm to view */
-      time[HOUR]= alarms[alarm_day][HOUR];
-      time[MIN] = alarms[alarm_day][MIN];     
-    }
+  /* VIEW_ALARM mode */
+  else if (mode[CLOCK_MODE] == VIEW_ALARM) {
+    control = FLASH_ALARM_DAY;
     
-    /* ENABLE_ALARM mode */
-    else if (mode[CLOCK_MODE] == ENABLE_ALARM) {
-      control = NONE;
+    /* Update time */
+    time_read();
     
-      /* Toggle alarm enable */
-      alarms[alarm_day][ALM_ENABLE] = !alarms[alarm_day][ALM_ENABLE];
-      alarm_write();
+    /* Change mode? */
+    if (alarm_check()) {
+      health_count(HEALTH_ALARM);
+      LATENCY_BEGIN(LATENCY_ALARM, rollover_ms);
+      mode[CLOCK_MODE] = ACTIVATE_ALARM;
+      if (alarm_mode==IPOD) {
+        ipod_play();
+      }
+    } else bind_match();
+    
+    /* Did the view time expire? */
+    if (view == FALSE) {
       alarm_day = NONE;
-      
       mode[CLOCK_MODE]=CLOCK;
     }
-      
-    /* ACTIVATE_ALARM mode */
-    else if (mode[CLOCK_MODE] == ACTIVATE_ALARM) {
-      control = FLASH_HOUR | FLASH_MIN;
-      if (mode[ALARM_MODE]==BUZZER) {
-        control |= ALARM_ON;
-      }
-         
-      /* Update time */
-      time_read();
-          
-      /* Change mode? */
-      if (released(DOWN, 0, NO_BEEP) | released(SEL, 0, NO_BEEP) | released(UP, 0, NO_BEEP)) {
-        mode[CLOCK_MODE]=CLOCK;
-        alarms[SNOOZE][ALM_ENABLE]=TRUE;
-        alarms[SNOOZE][MIN]=time[MIN]+SNOOZE_TIME;
-        alarms[SNOOZE][HOUR]=time[HOUR];
-        if (alarms[SNOOZE][MIN]>59) {
-          alarms[SNOOZE][MIN]-=60;
-          alarms[SNOOZE][HOUR]++;
-        }
-        if (alarms[SNOOZE][HOUR]>23) {
-          alarms[SNOOZE][HOUR]-=24;
-        }        
-        if (mode[ALARM_MODE]==IPOD) {
-          ipod_off();
-        }
-      } else if (held(DOWN, 20, LOCK_BUTTON, NO_BEEP) | held(SEL, 20, LOCK_BUTTON, NO_BEEP) | held(UP, 20, LOCK_BUTTON, NO_BEEP)) {
-        mode[CLOCK_MODE]=CLOCK;
-        alarms[SNOOZE][ALM_ENABLE]=FALSE;
-        if (mode[ALARM_MODE]==IPOD) {
-          ipod_off();
-        }
-      }
+    
+    /* Load alarm to view */
+    alarm_load(alarm_day);
+  }
+  
+  /* ENABLE_ALARM mode */
+  else if (mode[CLOCK_MODE] == ENABLE_ALARM) {
+    control = NONE;
+  
+    /* Toggle alarm enable */
+    if (!alarm_toggle(alarm_day)) sound_start(SOUND_BEEP, full_pattern);
+    alarm_day = NONE;
+    
+    mode[CLOCK_MODE]=CLOCK;
+  }
+    
+  /* ACTIVATE_ALARM mode */
+  else if (mode[CLOCK_MODE] == ACTIVATE_ALARM) {
+    control = FLASH_HOUR | FLASH_MIN;
+    if (alarm_mode==BUZZER) {
+      control |= ALARM_ON;
     }
-
-    /* Flush output */
-    flush();
+       
+    /* Update time */
+    time_read();
+        
+    /* Change mode? */
+    bind_match();
   }
+  
+  PROF_END(PROF_MODE);
+
+  /* Flush output */
+  PROF_BEGIN(PROF_FLUSH);
+  flush();
+  PROF_END(PROF_FLUSH);
 }
 
+
 /* Initalizes the clock upon bootup */
 void init(void) {
   int i;
+  char r, b[3];
+
+  /* Load the health counters before anything can count */
+  health_load();
+
+  /* Initalize clock chip */
+  r = CLOCK_SEC_ADDR;
+  i2c_write(CLOCK_ADDR, &r, 1, 0, 0);
+  if (!i2c_timeout) i2c_read(CLOCK_ADDR, b, 3);
+  if (!i2c_timeout) {
+    b[0] = b[0] & ~CH_MASK;                // Set CH = 0
+    b[2] = b[2] & ~TIME_MODE_MASK;         // Set 12/24 = 0
+    i2c_write(CLOCK_ADDR, &r, 1, b, 3);
+  }
+  r = CLOCK_CTR_ADDR;
+  b[0] = CLOCK_CTR_BITS;
+  i2c_write(CLOCK_ADDR, &r, 1, b, 1);
+ 
+  /* Load the main loop state */
+  state_load();
+  
+  /* Wake iPod up */
+  ipod_skip_back();
+  
+  /* Wait for iPod to wake up */
+  for (i=0; i<1000; i++) {}
+  
+  /* Turn the iPod off */
+  ipod_off();
+}
+
+/* Sets the main loop state as at power on, reading the time, its
+   volatility and the alarms from their chips */
+void state_load(void) {
+  char r, b;
 
   /* Check for power loss */
-  buffer[0] = CLOCK_MODE_ADDR;
-  i2c_write(CLOCK_ADDR, buffer, 1);
-  i2c_read(CLOCK_ADDR, buffer, 1);
-  if (buffer[0] != CLOCK_SET) time_volatile(FALSE);
+  r = CLOCK_MODE_ADDR;
+  i2c_write(CLOCK_ADDR, &r, 1, 0, 0);
+  if (!i2c_timeout) i2c_read(CLOCK_ADDR, &b, 1);
+  if (i2c_timeout || b != CLOCK_SET) time_volatile(FALSE);
   else time_volatile(TRUE);
  
   /* Set modes */
@@ -675,97 +1295,111 @@ void init(void) {
   
   /* Initialize timers */
   flash_ds=1;
-  beep_ds=1;
-  buzz_ds=1;
   view_ds=1;
   off_ds=1;
  
-  /* Initalize clock chip */
-  buffer[0] = CLOCK_SEC_ADDR;
-  i2c_write(CLOCK_ADDR, buffer, 1);
-  i2c_read(CLOCK_ADDR, buffer, 3);
-  buffer[3] = buffer[2] & ~TIME_MODE_MASK; // Set 12/24 = 0
-  buffer[2] = buffer[1];
-  buffer[1] = buffer[0] & ~CH_MASK;        // Set CH = 0
-  buffer[0] = CLOCK_SEC_ADDR;
-  i2c_write(CLOCK_ADDR, buffer, 4);
-  buffer[0] = CLOCK_CTR_ADDR;
-  buffer[1] = CLOCK_CTR_BITS;
-  i2c_write(CLOCK_ADDR, buffer, 2);
- 
   /* Load time and alarms */  
   time_read();
-  alarm_read();
-  alarms[SNOOZE][ALM_ENABLE]=FALSE;
-  
-  /* Wake iPod up */
-  ipod_skip_back();
-  
-  /* Wait for iPod to wake up */
-  for (i=0; i<1000; i++) {}
-  
-  /* Turn the iPod off */
-  ipod_off();
+  schedule_read();
+  snooze &= ~ALARM_ENABLE;
 }
 
 /* Flushes the output to the board */
 void flush() {
-  char i;
+  char i, out, day, hour, min;
+  unsigned int t;
+  
+  /* Split the time into fields for display */
+  day = time_day(time);
+  t = time - day_start[day];
+  hour = t / MINUTES_PER_HOUR;
+  min = t - hour * MINUTES_PER_HOUR;
  
   /* Output hour */
-  if (control & FLASH_HOUR && !flash) data = BLANK;
+  if (control & FLASH_HOUR && !flash) out = BLANK;
   else {
     /* Format the hour, convert to BCD and swap the nibbles! */
-    data = sn(dec2bcd(time_format(time[HOUR])));
+    out = sn(dec2bcd(time_format(hour)));
     
     /* Display AM/PM? */
-    if (mode[TIME_MODE] == NORMAL && (data & 0x0F) == 0) data = data | 0x0F;
+    if (time_mode == NORMAL && (out & 0x0F) == 0) out = out | 0x0F;
   }
-  addr = HOUR_ADDR;
-  addr = SEND;
+  latch(HOUR_ADDR, out);
    
   /* Output minute */    
-  if (control & FLASH_MIN && !flash) data = BLANK;
+  if (control & FLASH_MIN && !flash) out = BLANK;
   else {
     /* Convert to BCD and swap the nibbles! */
-    data = sn(dec2bcd(time[MIN]));
+    out = sn(dec2bcd(min));
   }
-  addr = MIN_ADDR;
-  addr = SEND;
+  latch(MIN_ADDR, out);
        
   /* Write output bank 0 */
   if ((control & FLASH_DAY) && !flash) output[0] = output[0] | DAYS_MASK;
-  else output[0] = (output[0] | DAYS_MASK) & ~(1 << time[DAY]);
-  data = output[0];
-  addr = OUTPUT0_ADDR;
-  addr = SEND;
+  else output[0] = (output[0] | DAYS_MASK) & ~(1 << day);
+  latch(OUTPUT0_ADDR, output[0]);
         
-  /* Write output bank 1 */
-  if (beep) output[1] = (output[1] | BEEP_MASK);
-  else output[1] = output[1] & ~BEEP_MASK;
+  /* Write output bank 1, built up locally as the sound ISR relatches it */
+  out = output[1];
   for (i=SUN; i<=SAT; i++) {
-    if ( (alarms[i][ALM_ENABLE] && i!=alarm_day) ||
-          (alarms[i][ALM_ENABLE] && !(control & FLASH_ALARM_DAY) && i == alarm_day) ||
+    if ( ((schedule_days & (1 << i)) && i!=alarm_day) ||
+          ((schedule_days & (1 << i)) && !(control & FLASH_ALARM_DAY) && i == alarm_day) ||
           ((control & FLASH_ALARM_DAY) && flash && i == alarm_day) ) {
-      output[1] = output[1] & ~(1 << i);
+      out = out & ~(1 << i);
     }
-    else output[1] = output[1] | (1 << i);
+    else out = out | (1 << i);
   }
-  data = output[1];
-  addr = OUTPUT1_ADDR;
-  addr = SEND;
+  output[1] = out;
+  latch(OUTPUT1_ADDR, output[1]);
  
-  /* Write output bank 2 */
-  if ((control & ALARM_ON) && buzz) output[2] = (output[2] | ALARM_MASK);
-  else output[2] = output[2] & ~ALARM_MASK;
+#ifndef NO_BUZZER
+  /* Start or stop the alarm sound as the alarm comes on or goes off */
+  if ((control & ALARM_ON) && !buzz) {
+    buzz = TRUE;
+    sound_start(SOUND_ALARM, alarm_pattern);
+  } else if (!(control & ALARM_ON) && buzz) {
+    buzz = FALSE;
+    sound_stop(SOUND_ALARM);
+  }
+#endif
+  
+  /* Write output bank 2, built up locally as the sound ISR relatches it */
+  out = output[2];
   if ((control & FLASH_HOUR) || (control & FLASH_MIN) || (control & FLASH_DAY) || (control & FLASH_ALARM_DAY)
-            || (!debug && (time[SEC] % 2 == 0)) || (debug && (time[MIN] % 2 == 0))) output[2] = (output[2] & ~COLON_MASK);
-  else output[2] = (output[2] | COLON_MASK);
-  if ((control & FLASH_HOUR) && !flash) output[2] = (output[2] | ONE_DIGIT_MASK);
+            || (!debug && (second % 2 == 0)) || (debug && (time % 2 == 0))) out = (out & ~COLON_MASK);
+  else out = (out | COLON_MASK);
+  if ((control & FLASH_HOUR) && !flash) out = (out | ONE_DIGIT_MASK);
+  output[2] = out;
   
-  data = output[2];
-  addr = OUTPUT2_ADDR;
-  addr = SEND;   
+  latch(OUTPUT2_ADDR, output[2]);
+  
+#ifdef TICK_LOCKED
+  trace_display();
+#endif
+}
+
+/* Writes v to the display latch at address a, with the sound bits the
+   ISR owns merged in */
+void latch(char a, char v) {
+  DisableInterrupts;            // The sound ISR latches too
+  data = v | sound_bits(a);
+  addr = a;
+  addr = SEND;
+  BUS_EVENT(BUS_LATCH | a, data);
+  EnableInterrupts;
+  ENERGY_ADD(ENERGY_LATCH, CHARGE_LATCH);
+#if defined(TICK_LOCKED) || defined(LATENCY)
+  if (shown[a-1] != v) {
+#ifdef LATENCY
+    if (latency_acted && ((v ^ shown[a-1]) & latency_bits[a-1])) {
+      latency_acted = FALSE;
+      LATENCY_MARK(LATENCY_DISPLAY);
+    }
+#endif
+    shown[a-1] = v;
+    shown_changed = TRUE;
+  }
+#endif
 }
 
 /* Scan the buttons and update the states */
@@ -792,6 +1426,108 @@ void scan() {
   }
 }
 
+/* Runs the first binding of the current mode whose gesture fires. Only
+   bindings on buttons pressed or still settling a press are tried, the
+   rest cannot fire, so a pass with no buttons busy stops at the scan */
+void bind_match(void) {
+  const struct binding *b = mode_bindings[mode[CLOCK_MODE]];
+  unsigned int busy = 0;
+  char n;
+  for (n=0; n<INPUT_COUNT; n++) {
+    if (buttons[n][STATUS]==PRESSED || buttons[n][STATE]!=STATE_RESET) busy |= 1 << n;
+  }
+  if (!busy) return;
+  for (; b->button != BIND_END; b++) {
+    if (b->button != BIND_DAYS) {
+      if ((busy & (1 << (b->button-1))) && bind_fire(b, b->button)) {
+        bind_do(b->action, b->button);
+        return;
+      }
+    } else for (n=SUN; n<=SAT; n++) {
+      if ((busy & (1 << (n-1))) && bind_fire(b, n)) {
+        bind_do(b->action, n);
+        return;
+      }
+    }
+  }
+}
+
+/* Checks the gesture of binding b on button n */
+char bind_fire(const struct binding *b, char n) {
+  if (b->gesture & BIND_HOLD) return held(n, b->start, b->repeat, b->gesture & BIND_BEEP);
+  return released(n, b->start, b->gesture & BIND_BEEP);
+}
+
+/* Runs binding action a for button n */
+void bind_do(char a, char n) {
+#ifdef LATENCY
+  latency_acted = a >= ACT_SET_CLOCK;  // The iPod actions show nothing
+#endif
+  if (a == ACT_PAUSE) ipod_pause();
+  else if (a == ACT_SKIP_BACK) ipod_skip_back();
+  else if (a == ACT_SKIP_FORWARD) ipod_skip_forward();
+  else if (a == ACT_VOLUME_UP) ipod_volume_up();
+  else if (a == ACT_VOLUME_DOWN) ipod_volume_down();
+  else if (a == ACT_SET_CLOCK) {
+    time_read();
+    mode[CLOCK_MODE] = SET_CLOCK_HOUR;
+    time_volatile(FALSE);
+  } else if (a == ACT_VIEW_ALARM) {
+    alarm_day = n;
+    view = TRUE;
+    view_ds=1;
+    mode[CLOCK_MODE] = VIEW_ALARM;
+  } else if (a == ACT_ENABLE_ALARM) {
+    alarm_day = n;
+    mode[CLOCK_MODE] = ENABLE_ALARM;
+  } else if (a == ACT_SET_ALARM) {
+    alarm_day = n;
+    alarm_load(alarm_day);      // Load alarm to set
+    mode[CLOCK_MODE] = SET_ALARM_HOUR;
+  }
+  else if (a == ACT_HOUR_DOWN) time = time_add(time, -MINUTES_PER_HOUR, MINUTES_PER_DAY);
+  else if (a == ACT_HOUR_UP) time = time_add(time, MINUTES_PER_HOUR, MINUTES_PER_DAY);
+  else if (a == ACT_HOURS_DOWN) {
+    if (time_mode == NORMAL) time = time_add(time, -HALF_DAY, MINUTES_PER_DAY);
+    else time = time_add(time, -MINUTES_PER_HOUR, MINUTES_PER_DAY);
+  } else if (a == ACT_HOURS_UP) {
+    if (time_mode == NORMAL) time = time_add(time, HALF_DAY, MINUTES_PER_DAY);
+    else time = time_add(time, MINUTES_PER_HOUR, MINUTES_PER_DAY);
+  }
+  else if (a == ACT_MIN_DOWN) time = time_add(time, -1, MINUTES_PER_HOUR);
+  else if (a == ACT_MIN_UP) time = time_add(time, 1, MINUTES_PER_HOUR);
+  else if (a == ACT_DAY_DOWN) time = time_add(time, -MINUTES_PER_DAY, MINUTES_PER_WEEK);
+  else if (a == ACT_DAY_UP) time = time_add(time, MINUTES_PER_DAY, MINUTES_PER_WEEK);
+  else if (a == ACT_NEXT) mode[CLOCK_MODE]++;
+  else if (a == ACT_CLOCK_DONE) {
+    mode[CLOCK_MODE]=CLOCK;
+    second = 0;
+    time_write();
+    time_volatile(TRUE);
+  } else if (a == ACT_ALARM_DONE) {
+    mode[CLOCK_MODE]=CLOCK;
+    
+    /* Enable and save the alarm */
+    if (!alarm_set(alarm_day, time_of_day(time))) sound_start(SOUND_BEEP, full_pattern);
+    alarm_day = NONE;
+  } else if (a == ACT_SNOOZE) {
+    mode[CLOCK_MODE]=CLOCK;
+    health_count(HEALTH_SNOOZE);
+    snooze = time + snooze_time;
+    if (snooze >= MINUTES_PER_WEEK) snooze -= MINUTES_PER_WEEK;
+    snooze |= ALARM_ENABLE;
+    if (alarm_mode==IPOD) {
+      ipod_off();
+    }
+  } else if (a == ACT_DISMISS) {
+    mode[CLOCK_MODE]=CLOCK;
+    snooze &= ~ALARM_ENABLE;
+    if (alarm_mode==IPOD) {
+      ipod_off();
+    }
+  }
+}
+
 /* Check if button n has been held for t 1/20's of a second; r determines repeat setting; b determines if tactile feedback is given */
 char held(char n, signed char t, signed char r, char b) {
     assert(n>0 && n<=INPUT_COUNT);
@@ -802,11 +1538,11 @@ char held(char n, signed char t, signed char r, char b) {
     if (buttons[n][TOTAL_ELAPSE]>=t && t != NO_START && buttons[n][KEYFIRE_ELAPSE]==0 && buttons[n][STATE]==STATE_PRESSED) {
       if (r == LOCK_BUTTON) buttons[n][STATE]=STATE_LOCKED;
       else buttons[n][STATE]=STATE_HELD;
-      if (b) beep=TRUE;
+      if (b) sound_start(SOUND_BEEP, beep_pattern);
       return TRUE;
     } else if (buttons[n][KEYFIRE_ELAPSE]>=r && r != NO_REPEAT && buttons[n][STATE]==STATE_HELD) {
       buttons[n][KEYFIRE_ELAPSE]=0;
-      if (b) beep=TRUE;
+      if (b) sound_start(SOUND_BEEP, beep_pattern);
       return TRUE;
     }
     else return FALSE;
@@ -825,7 +1561,7 @@ char released(char n, signed char t, char b) {
     if (buttons[n][STATE]==STATE_RELEASED && buttons[n][PREV_ELAPSE]>=t) {
       buttons[n][PREV_ELAPSE]=0;
       buttons[n][STATE]=STATE_RESET;
-      if (b) beep=TRUE;
+      if (b) sound_start(SOUND_BEEP, beep_pattern);
       return TRUE;
     }      
     else return FALSE;
@@ -842,75 +1578,577 @@ char bcd2dec(char n) { return ( ((n >> 4) * 10) + (n & 0x0F) ); }
    segment digit and vice versa. Oops! */
 char sn(char n) { return (n << 4) | (n >> 4); }
 
-/* Saves the alarm for day d and writes the alarms to the EEPROM over the I2C bus */
-void alarm_write(void) {
-  buffer[0] = EEPROM_MSB_ADDR;
-  buffer[1] = EEPROM_ALM_ADDR + ALARM_SIZE*alarm_day;
-  buffer[2] = alarms[alarm_day][HOUR];
-  buffer[3] = alarms[alarm_day][MIN];
-  buffer[4] = alarms[alarm_day][ALM_ENABLE];
-  i2c_write(EEPROM_ADDR, buffer, 5);
-}
-
-/* Reads the saved alarms from the EEPROM over the I2C bus */
-void alarm_read(void) {
-  char i, j;
-  buffer[0] = EEPROM_MSB_ADDR;
-  buffer[1] = EEPROM_ALM_ADDR;
-  i2c_write(EEPROM_ADDR, buffer, 2);
-  i2c_read(EEPROM_ADDR, buffer, (ALARM_SIZE * ALARM_COUNT));
-  for (i=0; i<ALARM_COUNT; i++) {
-    for (j=0; j<ALARM_SIZE; j++) {
-      alarms[i][j] = buffer[(ALARM_SIZE*i + j)];
+/* Records the line of a failed assert in the health counters, saves them
+   and locks up with interrupts disabled. An assert failing during the
+   save just locks up */
+void fail(unsigned int line) {
+  if (!health_failing) {
+    health_failing = TRUE;
+    health.line = line;
+    health_save();
+  }
+  DisableInterrupts;
+  for(;;) {}
+}
+
+/* Loads the time of day of the first alarm on day d onto today for
+   displaying and setting, midnight if day d has none */
+void alarm_load(char d) {
+  char i = schedule_first(d);
+  time -= time_of_day(time);
+  if (i < schedule_count) time += time_of_day(schedule[i] & ALARM_TIME_MASK);
+}
+
+/* Replaces the first alarm on day d with an enabled alarm at minute m of
+   the day and saves the schedule. Returns FALSE, saving nothing, if the
+   table is full */
+char alarm_set(char d, unsigned int m) {
+  struct rule r;
+  char i = schedule_first(d);
+  if (i < schedule_count) schedule_remove(i);
+  r.days = 1 << d;
+  r.minute = m;
+  r.flags = ALARM_ENABLE;
+  if (!schedule_add(&r)) return FALSE;
+  schedule_update();
+  schedule_write();
+  return TRUE;
+}
+
+/* Toggles the first alarm on day d, or enables one at midnight if day d
+   has none, and saves the schedule. Returns FALSE, saving nothing, if
+   the table is full */
+char alarm_toggle(char d) {
+  char i = schedule_first(d);
+  if (i < schedule_count) schedule[i] ^= ALARM_ENABLE;
+  else if (!schedule_insert(day_start[d] | ALARM_ENABLE)) return FALSE;
+  schedule_update();
+  schedule_write();
+  return TRUE;
+}
+
+/* Returns the index of the first entry at or after minute of week t,
+   schedule_count if there is none */
+char schedule_find(unsigned int t) {
+  char lo = 0, hi = schedule_count, mid;
+  while (lo < hi) {
+    mid = (lo + hi) >> 1;
+    if ((schedule[mid] & ALARM_TIME_MASK) < t) lo = mid + 1;
+    else hi = mid;
+#ifdef REPORTING
+    schedule_steps++;
+#endif
+  }
+  return lo;
+}
+
+/* Returns the index of the first entry on day d, schedule_count if none */
+char schedule_first(char d) {
+  char i = schedule_find(day_start[d]);
+  if (i < schedule_count && (schedule[i] & ALARM_TIME_MASK) < day_start[d] + MINUTES_PER_DAY) return i;
+  return schedule_count;
+}
+
+/* Inserts entry e in order, replacing an entry at the same minute.
+   Returns FALSE if the table is full */
+char schedule_insert(unsigned int e) {
+  char i = schedule_find(e & ALARM_TIME_MASK);
+  char j;
+  if (i < schedule_count && (schedule[i] & ALARM_TIME_MASK) == (e & ALARM_TIME_MASK)) {
+    schedule[i] = e;
+    return TRUE;
+  }
+  if (schedule_count == SCHEDULE_SIZE) return FALSE;
+  for (j=schedule_count; j>i; j--) schedule[j] = schedule[j-1];
+  schedule[i] = e;
+  schedule_count++;
+  return TRUE;
+}
+
+/* Removes entry i */
+void schedule_remove(char i) {
+  schedule_count--;
+  for (; i<schedule_count; i++) schedule[i] = schedule[i+1];
+}
+
+/* Adds an entry for every day named by rule r. Returns FALSE if the
+   table filled up */
+char schedule_add(const struct rule *r) {
+  char d;
+  for (d=SUN; d<=SAT; d++) {
+    if ((r->days & (1 << d)) && !schedule_insert((day_start[d] + r->minute) | r->flags)) return FALSE;
+  }
+  return TRUE;
+}
+
+/* Replaces the schedule with the n rules r. Returns FALSE if they did
+   not all fit */
+char schedule_compile(const struct rule *r, char n) {
+  char ok = TRUE;
+  schedule_count = 0;
+  while (n-- > 0) {
+    if (!schedule_add(r++)) ok = FALSE;
+  }
+  schedule_update();
+  return ok;
+}
+
+/* Recomputes the days with an enabled alarm after the table changed */
+void schedule_update(void) {
+  char i;
+  schedule_days = 0;
+  for (i=0; i<schedule_count; i++) {
+    if (schedule[i] & ALARM_ENABLE) schedule_days |= 1 << time_day(schedule[i] & ALARM_TIME_MASK);
+  }
+  schedule_time = SCHEDULE_STALE;
+}
+
+/* Keeps schedule_next on the first entry at or after the current minute,
+   stepping forward as time passes and searching again after a jump */
+void schedule_sync(void) {
+#ifdef REPORTING
+  schedule_steps = 0;
+#endif
+  if (time == schedule_time + 1) {
+    while (schedule_next < schedule_count && (schedule[schedule_next] & ALARM_TIME_MASK) < time) {
+      schedule_next++;
+#ifdef REPORTING
+      schedule_steps++;
+#endif
     }
+  } else if (time != schedule_time) {
+    schedule_next = schedule_find(time);
   }
+  schedule_time = time;
 }
 
-/* Checks the alarms for a match */
+/* Copies the stored page to b */
+void store_image(char *b) {
+  const char *s = (const char *)&store;
+  char i;
+  for (i=0; i<STORE_SIZE; i++) *b++ = *s++;
+}
+
+/* Checks the stored page image b. The table must be sorted and in range
+   and the settings in range */
+char store_valid(const char *b) {
+  const struct store *s = (const struct store *)b;
+  char i;
+  unsigned int t, last = 0;
+  if ((unsigned char)s->count > SCHEDULE_SIZE) return FALSE;
+  for (i=0; i<s->count; i++) {
+    t = s->entry[i] & ALARM_TIME_MASK;
+    if (t >= MINUTES_PER_WEEK || (i > 0 && t <= last)) return FALSE;
+    last = t;
+  }
+  return s->snooze >= 1 && s->snooze <= SNOOZE_MAX;
+}
+
+/* Loads the schedule and settings from the stored page image b. An image
+   that is not valid is refused and FALSE returned with nothing changed */
+char store_load(const char *b) {
+  char *d = (char *)&store;
+  char i;
+  if (!store_valid(b)) return FALSE;
+  for (i=0; i<STORE_SIZE; i++) *d++ = *b++;
+  schedule_update();
+  return TRUE;
+}
+
+#ifdef FLASH_STORE
+/* Appends the schedule and settings to the flash log */
+void schedule_write(void) {
+  flash_append();
+}
+
+/* Reads the schedule and settings from the newest record of the flash
+   log, a plain memory read */
+void schedule_read(void) {
+  char *r = flash_scan();
+  char *d = (char *)&store;
+  char i;
+  if (r == 0) schedule_count = FLASH_ERASED;
+  else for (i=1; i<=STORE_SIZE; i++) *d++ = r[i];
+  store_check();
+}
+#else
+/* Writes the schedule and settings to the EEPROM over the I2C bus, all
+   within the first page so it is a single write cycle */
+void schedule_write(void) {
+  char a[2];
+  a[0] = EEPROM_MSB_ADDR;
+  a[1] = EEPROM_ALM_ADDR;
+  if (!eeprom_wait()) return;
+  i2c_write(EEPROM_ADDR, a, 2, (char *)&store, STORE_SIZE);
+}
+
+/* Reads the schedule and settings from the EEPROM over the I2C bus
+   straight into place */
+void schedule_read(void) {
+  char a[2];
+  a[0] = EEPROM_MSB_ADDR;
+  a[1] = EEPROM_ALM_ADDR;
+  if (eeprom_wait()) {
+    i2c_write(EEPROM_ADDR, a, 2, 0, 0);
+    if (!i2c_timeout) i2c_read(EEPROM_ADDR, (char *)&store, STORE_SIZE);
+  }
+  store_check();
+}
+#endif
+
+/* Checks the schedule and settings just read. Bad settings, such as from
+   a page written before they were stored, fall back to the defaults. A
+   page that still does not check out, such as a blank one, leaves no
+   alarms */
+void store_check(void) {
+  if (!store_valid((char *)&store)) {
+    snooze_time = SNOOZE_TIME;
+    if (!store_valid((char *)&store)) schedule_count = 0;
+  }
+  schedule_update();
+}
+
+/* Polls the EEPROM until it acknowledges its address. The 24LC256 NAKs
+   everything while a write cycle is in progress, so this must be called
+   before any transaction that could follow a write. An acknowledge is
+   waited for as in i2c_write(), RXAK clearing, but only for the time of
+   an address. Returns FALSE, with i2c_timeout set, if the bus timed out
+   or the EEPROM never acknowledged */
+char eeprom_wait(void) {
+  char i, a;
+  for (i=0; i<EEPROM_POLL_COUNT; i++) {
+    PROF_BEGIN(PROF_I2C);
+    i2c_start_timeout();        // Start I2C watchdog timer
+    while (MIMCR_MMBB) {        // Wait for bus not busy
+      if (i2c_timeout) return FALSE;
+    }
+    MMSR_MMTXIF = 0;            // Set MMDRR writable
+    MIMCR_MMRW = 0;             // Set for transmit
+    i2c_device = EEPROM_ADDR;
+    BUS_EVENT_MAIN(BUS_I2C_START, EEPROM_ADDR);
+    ENERGY_ADD(ENERGY_I2C, CHARGE_I2C);
+    MMADR = EEPROM_ADDR;        // Device address -> address reg
+    MMDTR = EEPROM_MSB_ADDR;    // Dummy data, never committed
+    MIMCR_MMAST = 1;            // Start transmission
+    while (MMSR_MMRXAK && T1CNT < EEPROM_ACK_TIME) {  // Wait for ACK from slave
+      if (i2c_timeout) return FALSE;
+    }
+    a = !MMSR_MMRXAK;
+    MIMCR_MMAST = 0;            // Generate STOP bit
+    BUS_EVENT_MAIN(BUS_I2C_STOP, FALSE);
+    T1SC_TSTOP = 1;             // Stop I2C watchdog timer
+    PROF_END(PROF_I2C);
+    if (a) return TRUE;         // Acknowledged, write cycle is done
+    health_count(HEALTH_EEPROM_NAK);
+  }
+  i2c_timeout = TRUE;
+  return FALSE;
+}
+
+#ifdef FLASH_STORE
+/* Sums a record. A good record sums to zero */
+char flash_sum(const char *r) {
+  char i, s = 0;
+  for (i=0; i<FLASH_RECORD_SIZE; i++) s += r[i];
+  return s;
+}
+
+/* Finds the newest good record in the log and the free slot after it.
+   Sequence numbers are compared modulo 256, so they may wrap, and a
+   record cut short by a reset fails its checksum and is passed over */
+char *flash_scan(void) {
+  char p, i;
+  unsigned int o;
+  char *r;
+  flash_last = 0;
+  flash_next = 0;
+  for (p=0; p<FLASH_PAGES; p++) {
+    r = FLASH_LOG + p*FLASH_PAGE_SIZE;
+    for (i=0; i<FLASH_RECORDS; i++, r+=FLASH_RECORD_SIZE) {
+      if (r[0] == FLASH_ERASED || flash_sum(r)) continue;
+      if (flash_last && (signed char)(r[0] - flash_seq) <= 0) continue;
+      flash_last = r;
+      flash_seq = r[0];
+    }
+  }
+  if (flash_last) {
+    r = FLASH_LOG + (flash_last - FLASH_LOG) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+    for (o=flash_last+FLASH_RECORD_SIZE-r; o<=FLASH_PAGE_SIZE-FLASH_RECORD_SIZE; o+=FLASH_RECORD_SIZE) {
+      if (r[o] == FLASH_ERASED) {
+        flash_next = r + o;
+        break;
+      }
+    }
+  }
+  return flash_last;
+}
+
+/* Appends the schedule and settings to the log. When the page of the
+   newest record is full the other page is erased and the log carries on
+   there, so the newest record always survives a reset mid erase */
+void flash_append(void) {
+  char h, s;
+  char i;
+  const char *d = (const char *)&store;
+  if (flash_next == 0) {
+    if (flash_last == 0 || flash_last >= FLASH_LOG + FLASH_PAGE_SIZE)
+      flash_next = FLASH_LOG;
+    else flash_next = FLASH_LOG + FLASH_PAGE_SIZE;
+    flash_erase(flash_next);
+  }
+  h = flash_seq + 1;
+  if (h == FLASH_ERASED) h++;
+  s = h;
+  for (i=0; i<STORE_SIZE; i++) s += d[i];
+  s = -s;
+  flash_write(flash_next, &h, 1);
+  flash_write(flash_next + 1, d, STORE_SIZE);
+  flash_write(flash_next + 1 + STORE_SIZE, &s, 1);
+  flash_last = flash_next;
+  flash_seq = h;
+  flash_next += FLASH_RECORD_SIZE;
+  if ((flash_next - FLASH_LOG) % FLASH_PAGE_SIZE > FLASH_PAGE_SIZE - FLASH_RECORD_SIZE)
+    flash_next = 0;
+}
+
+/* Programs n bytes to flash, one high voltage cycle each so a row is
+   never crossed whatever its size */
+void flash_write(char *p, const char *s, char n) {
+  flash_call(p, s, n);
+}
+
+/* Erases the log page at p a step at a time, so it is wholly erased
+   whether the part erases FLASH_ERASE_STEP bytes or the whole page at
+   once. The latter costs the page more erase cycles, a few thousand
+   saves' worth of its endurance */
+void flash_erase(char *p) {
+  char i;
+  for (i=0; i<FLASH_PAGE_SIZE/FLASH_ERASE_STEP; i++, p+=FLASH_ERASE_STEP) flash_call(p, 0, 0);
+}
+
+/* Runs flash_run() from a copy on the stack, erasing the page at p when
+   n is 0 and otherwise programming n bytes from s to p. The array cannot
+   be read while it is programmed or erased and the vectors and handlers
+   are in it, so interrupts stay off, which also keeps their frames off
+   the copy */
+void flash_call(char *p, const char *s, char n) {
+  char run[FLASH_RUN_SIZE];
+  char i;
+  PROF_BEGIN(PROF_FLASH);
+  DisableInterrupts;
+  for (i=0; i<FLASH_RUN_SIZE; i++) run[i] = __SEG_START_FLASH_ROUTINE[i];
+  if (n == 0) {
+    flash_mode = FLASH_ERASE;
+    ((void (*)(char *))run)(p);
+  } else {
+    flash_mode = FLASH_PGM;
+    while (n--) {
+      flash_data = *s++;
+      ((void (*)(char *))run)(p++);
+    }
+  }
+  EnableInterrupts;
+  PROF_END(PROF_FLASH);
+}
+
+/* Erases the page at p, in H:X, when flash_mode is FLASH_ERASE, otherwise
+   programs flash_data to p. Runs only from the copy on the stack, so it
+   branches only relative and calls nothing. Bus cycles are counted from
+   the write that starts each wait to the one that ends it */
+#pragma CODE_SEG FLASH_ROUTINE
+#pragma NO_ENTRY
+#pragma NO_EXIT
+void flash_run(char *p) {
+  asm {
+          LDA   flash_mode
+          STA   FLCR              // PGM or ERASE
+          LDA   FLBPR             // Read the block protect register
+          STA   ,X                // Latch the row or page
+          LDA   #FLASH_T_NVS
+    nvs:  DBNZA nvs
+          LDA   FLCR
+          ORA   #FLASH_HVEN
+          STA   FLCR
+          BIT   #FLASH_ERASE
+          BNE   erase
+          LDA   #FLASH_T_PGS
+    pgs:  DBNZA pgs
+          LDA   flash_data
+          STA   ,X                // Program the byte
+          LDA   #FLASH_T_PROG     // 2 cycles
+    prog: DBNZA prog              // 3 a pass
+          BRA   off               // 3
+    erase: LDX  #FLASH_T_ERASE
+    page: CLRA                    // 1, then 256 passes
+    pass: DBNZA pass
+          DBNZX page              // 3
+    off:  LDA   #FLASH_HVEN       // 2
+          STA   FLCR              // 4, PGM or ERASE off
+          LDA   #FLASH_T_NVH
+    nvh:  DBNZA nvh
+          CLRA
+          STA   FLCR              // HVEN off
+          LDA   #FLASH_T_RCV
+    rcv:  DBNZA rcv
+          RTS
+  }
+}
+#pragma CODE_SEG DEFAULT
+#endif
+
+/* Checks the snooze and the next scheduled alarm for a match, one shot
+   alarms are removed as they fire */
 char alarm_check(void) {
-  if (((alarms[time[DAY]][ALM_ENABLE] && alarms[time[DAY]][HOUR]==time[HOUR] && alarms[time[DAY]][MIN]==time[MIN]) 
-        || (alarms[SNOOZE][ALM_ENABLE] && alarms[SNOOZE][HOUR]==time[HOUR] && alarms[SNOOZE][MIN]==time[MIN])) 
-        && time[SEC]==0) return TRUE;
-  else return FALSE;
+  unsigned int e;
+  if (second != 0) {
+#ifdef LATENCY
+    DisableInterrupts;
+    rollover_ms = msec;
+    EnableInterrupts;
+#endif
+    if (time != alarm_seen) alarm_missed();
+    return FALSE;
+  }
+  alarm_seen = time;
+  if (snooze == (time | ALARM_ENABLE)) return TRUE;
+  schedule_sync();
+  if (schedule_next >= schedule_count) return FALSE;
+  e = schedule[schedule_next];
+  if ((e & ALARM_TIME_MASK) != time || !(e & ALARM_ENABLE)) return FALSE;
+  if (e & ALARM_ONCE) {
+    schedule_remove(schedule_next);
+    schedule_update();
+    schedule_write();
+  }
+  return TRUE;
+}
+
+/* Counts an alarm or snooze due this minute as missed, called when the
+   pass at its first second never came, such as while a setting mode was
+   up or the bus was timing out. Minutes skipped whole go unnoticed */
+void alarm_missed(void) {
+  unsigned int e;
+  alarm_seen = time;
+  if (snooze == (time | ALARM_ENABLE)) {
+    health_count(HEALTH_MISSED);
+    return;
+  }
+  schedule_sync();
+  if (schedule_next >= schedule_count) return;
+  e = schedule[schedule_next];
+  if ((e & ALARM_TIME_MASK) == time && (e & ALARM_ENABLE)) health_count(HEALTH_MISSED);
 }
 
 /* Writes the time to the clock over the I2C bus */
 void time_write(void) {
+  char r = CLOCK_SEC_ADDR;
+  char b[CLOCK_TIME_SIZE];
+  time_fill(b);
+  i2c_write(CLOCK_ADDR, &r, 1, b, CLOCK_TIME_SIZE);
+}
+
+/* Writes the time to the clock and marks it set in one burst, running on
+   through the unused date and month into the set flag */
+void time_write_set(void) {
+  char r = CLOCK_SEC_ADDR;
+  char b[CLOCK_SET_SIZE];
+  time_fill(b);
+  b[4] = 1;                     // Date
+  b[5] = 1;                     // Month
+  b[6] = CLOCK_SET;             // CLOCK_MODE_ADDR
+  i2c_write(CLOCK_ADDR, &r, 1, b, CLOCK_SET_SIZE);
+  clock_set = TRUE;
+}
+
+/* Hands the time to the debug clock when it is running and fills b with
+   the clock's second, minute, hour and day registers. A minute written
+   to the clock was not missed */
+void time_fill(char *b) {
+  char day, hour;
+  unsigned int t;
+  alarm_seen = time;
+#ifndef NO_DEBUG_CLOCK
   if (debug) {
-    debug_time[SEC] = time[SEC];
-    debug_time[MIN] = time[MIN];
-    debug_time[HOUR]= time[HOUR];
-    debug_time[DAY] = time[DAY];
+    debug_time = time;
+    debug_second = second;
   }
-  buffer[0] = CLOCK_SEC_ADDR;
-  buffer[1] = (dec2bcd(time[SEC]) & SEC_MASK);
-  buffer[2] = dec2bcd(time[MIN]) & MIN_MASK;
-  buffer[3] = dec2bcd(time[HOUR]) & HOUR_MASK;
-  buffer[4] = time[DAY] & DAY_MASK;
-  i2c_write(CLOCK_ADDR, buffer, 5);
+#endif
+  day = time_day(time);
+  t = time - day_start[day];
+  hour = t / MINUTES_PER_HOUR;
+  b[0] = (dec2bcd(second) & SEC_MASK);
+  b[1] = dec2bcd(t - hour * MINUTES_PER_HOUR) & MIN_MASK;
+  b[2] = dec2bcd(hour) & HOUR_MASK;
+  b[3] = day & DAY_MASK;
 }
 
 /* Reads the time from the clock over the I2C bus */
 void time_read(void) {
+  PROF_BEGIN(PROF_TIME_READ);
+#ifndef NO_DEBUG_CLOCK
   if (debug) {
-    time[SEC] = debug_time[SEC];
-    time[MIN] = debug_time[MIN];
-    time[HOUR]=debug_time[HOUR];
-    time[DAY] =debug_time[DAY];
-  } else {  
-    buffer[0] = CLOCK_SEC_ADDR;
-    i2c_write(CLOCK_ADDR, buffer, 1);
-    i2c_read(CLOCK_ADDR, buffer, 4);
-    time[SEC] = bcd2dec(buffer[0] & SEC_MASK);
-    time[MIN] = bcd2dec(buffer[1] & MIN_MASK);
-    time[HOUR]= bcd2dec(buffer[2] & HOUR_MASK);
-    time[DAY] = buffer[3] & DAY_MASK;
+    time = debug_time;
+    second = debug_second;
+  } else
+#endif
+  {
+#ifdef TICK_LOCKED
+    /* Use the reading taken at the tick */
+    time = rtc_time;
+    second = rtc_second;
+#else
+    time = rtc_read(&second);
+#endif
+  }
+  PROF_END(PROF_TIME_READ);
+}
+
+/* Reads the time from the clock over the I2C bus, returning the minute of
+   the week and storing the second in s. If every try times out the time
+   held is returned unchanged */
+unsigned int rtc_read(char *s) {
+  char r = CLOCK_SEC_ADDR;
+  char b[CLOCK_TIME_SIZE];
+  char i;
+  for (i=0; i<CLOCK_TRIES; i++) {
+    if (i) health_count(HEALTH_RETRY);
+    i2c_write(CLOCK_ADDR, &r, 1, 0, 0);
+    if (!i2c_timeout) i2c_read(CLOCK_ADDR, b, CLOCK_TIME_SIZE);
+    if (!i2c_timeout) break;
+  }
+  if (i2c_timeout) {
+    *s = second;
+    return time;
   }
+  *s = bcd2dec(b[0] & SEC_MASK);
+  return day_start[b[3] & DAY_MASK] + bcd2dec(b[2] & HOUR_MASK) * MINUTES_PER_HOUR
+          + bcd2dec(b[1] & MIN_MASK);
+}
+
+/* Adds d minutes to t, wrapping within the span sized block t lies in so
+   that setting one field never carries into the next */
+unsigned int time_add(unsigned int t, int d, unsigned int span) {
+  int offset = t % span + d;
+  if (offset < 0) offset += span;
+  else if (offset >= (int)span) offset -= span;
+  return t - t % span + offset;
+}
+
+/* Returns the day of the week, SUN to SAT, of minute of week t */
+char time_day(unsigned int t) {
+  char d = SAT;
+  while (t < day_start[d]) d--;
+  return d;
+}
+
+/* Returns the minute of the day of minute of week t */
+unsigned int time_of_day(unsigned int t) {
+  return t - day_start[time_day(t)];
 }
 
 /* Formats the time to either normal or military time for displaying */
 char time_format(char hour) {
-  if (mode[TIME_MODE] == NORMAL ) {
+  if (time_mode == NORMAL ) {
     if (hour>=12) output[0] = output[0] & ~AM_PM_MASK;
     else output[0] = output[0] | AM_PM_MASK;
     if (hour==0 | (hour>=10 && hour <=12) | (hour>=22 && hour <=23)) output[2] = output[2] & ~ONE_DIGIT_MASK;
@@ -918,7 +2156,7 @@ char time_format(char hour) {
     if (hour==0) return 12;
     else if (hour>12) return hour-12;
     else return hour;   
-  } else if (mode[TIME_MODE] == MILITARY) {
+  } else if (time_mode == MILITARY) {
     if (hour>=10 && hour <=19) output[2] = output[2] & ~ONE_DIGIT_MASK;
     else output[2] = output[2] | ONE_DIGIT_MASK;
     output[0] = output[0] | AM_PM_MASK;
@@ -928,21 +2166,70 @@ char time_format(char hour) {
 
 /* Saves the time volatility to the clock chip */
 void time_volatile(char b) {
+  char r = CLOCK_MODE_ADDR;
+  char v;
   if (b == TRUE) {
     clock_set = TRUE;
-    buffer[0] = CLOCK_MODE_ADDR;
-    buffer[1] = CLOCK_SET;
-    i2c_write(CLOCK_ADDR, buffer, 2);
+    v = CLOCK_SET;
   } else {
     clock_set = FALSE;
-    buffer[0] = CLOCK_MODE_ADDR;
-    buffer[1] = CLOCK_NOT_SET;
-    i2c_write(CLOCK_ADDR, buffer, 2);
+    v = CLOCK_NOT_SET;
   }
+  i2c_write(CLOCK_ADDR, &r, 1, &v, 1);
 };
 
+/* Counts one event k, saturating */
+void health_count(char k) {
+  if (health.count[k] != 0xFFFF) {
+    health.count[k]++;
+    health_dirty = TRUE;
+  }
+}
+
+/* Reads the health counters from the clock's RAM, starting them over if
+   they do not check out, such as after the backup battery was changed */
+void health_load(void) {
+  char r = CLOCK_RAM_ADDR;
+  char i, s = 0;
+  i2c_write(CLOCK_ADDR, &r, 1, 0, 0);
+  i2c_read(CLOCK_ADDR, (char *)&health, HEALTH_SIZE);
+  for (i=0; i<HEALTH_SIZE; i++) s += ((char *)&health)[i];
+  if (s != 0 || i2c_timeout) {
+    for (i=0; i<HEALTH_COUNT; i++) health.count[i] = 0;
+    health.line = 0;
+  }
+  health_dirty = FALSE;
+}
+
+/* Checks the state once a tick. Counts a tick that finds it out of range
+   and a setting mode left without a press for STUCK_TIME */
+void health_check(void) {
+  if (!state_valid()) health_count(HEALTH_INVARIANT);
+  if (mode[CLOCK_MODE] == CLOCK || mode[CLOCK_MODE] == ACTIVATE_ALARM || (sample & INPUT_MASK))
+    stuck_ds = 0;
+  else if (++stuck_ds == STUCK_TIME) health_count(HEALTH_STUCK);
+}
+
+/* Returns FALSE if the mode, time or schedule state is out of range */
+char state_valid(void) {
+  return mode[CLOCK_MODE] < CLOCK_MODES && time < MINUTES_PER_WEEK && second <= 59
+      && schedule_count <= SCHEDULE_SIZE && schedule_next <= schedule_count && alarm_day <= SAT;
+}
+
+/* Writes the health counters to the clock's RAM in one burst */
+void health_save(void) {
+  char r = CLOCK_RAM_ADDR;
+  char i, s = 0;
+  health_dirty = FALSE;
+  for (i=0; i<HEALTH_DATA_SIZE; i++) s += ((char *)&health)[i];
+  health.check = -s;
+  i2c_write(CLOCK_ADDR, &r, 1, (char *)&health, HEALTH_SIZE);
+}
+
+#ifndef NO_IPOD
 /* Starts the iPod playing */
 void ipod_play(void) {
+  LATENCY_MARK(LATENCY_ALARM);  // The first byte goes straight out
   ipod_cmd_play();
   ipod_cmd_button_release();
   ipod_cmd_skip_back();
@@ -957,6 +2244,7 @@ void ipod_pause(void) {
 
 /* Stops the iPod playing */
 void ipod_off (void) {
+  LATENCY_MARK(LATENCY_SILENCE);
   ipod_cmd_stop();
   ipod_cmd_button_release();
   ipod_cmd_pause();
@@ -1083,25 +2371,286 @@ void ipod_cmd_button_release(void) {
   sci_write(0x00);
   sci_write(0xFB);              // Checksum
 }
+#endif
 
 /* Writes the byte ch to SCI port */
 void sci_write(unsigned char ch) {
-    while (SCS1_SCTE == 0);
+    while (SCS1_SCTE == 0);     // At most one byte time, WCET_SCI_BYTE
     SCDR = ch;
+    BUS_EVENT_MAIN(BUS_SCI, ch);
+    ENERGY_ADD(ENERGY_SCI, CHARGE_SCI);
+}
+
+/* Reads a byte from the SCI port */
+unsigned char sci_read(void) {
+    while (SCS1_SCRF == 0);
+    return SCDR;
+}
+
+/* Writes the string s to SCI port */
+void sci_print(const char *s) {
+    while (*s) sci_write(*s++);
+}
+
+/* Writes n to SCI port as decimal digits */
+void sci_dec(unsigned int n) {
+    char digits[5];
+    char i = 0;
+    do {
+      digits[i++] = '0' + n % 10;
+      n /= 10;
+    } while (n > 0);
+    while (i > 0) sci_write(digits[--i]);
+}
+
+/* The ISR for the SCI receiver. Collects a host frame byte by byte and
+   holds it for the loop if its checksum is good. Bytes that arrive while
+   a frame is held are dropped. The vector is always taken, the receiver
+   only interrupts in builds with the host frames */
+#pragma TRAP_PROC
+void host_rx(void) {
+#ifdef HOST
+    unsigned char b;
+    if (SCS1_OR) health_count(HEALTH_SCI_DROP);  // Status then data clears SCRF
+    b = SCDR;
+    if (host_ready) {
+      health_count(HEALTH_SCI_DROP);
+      return;
+    }
+    if (host_state == HOST_IDLE) {
+      if (b == 0xFF) {
+        host_ms = msec;
+        host_state = HOST_SYNC;
+      }
+    } else if (host_state == HOST_SYNC) {
+      if (b == HOST_HEADER) host_state = HOST_LENGTH;
+      else if (b != 0xFF) host_state = HOST_IDLE;
+    } else if (host_state == HOST_LENGTH) {
+      if (b == 0 || b > HOST_FRAME_SIZE) host_state = HOST_IDLE;
+      else {
+        host_length = b;
+        host_sum = b;
+        host_pos = 0;
+        host_state = HOST_BODY;
+      }
+    } else if (host_state == HOST_BODY) {
+      host_frame[host_pos++] = b;
+      host_sum += b;
+      if (host_pos == host_length) host_state = HOST_CHECKSUM;
+    } else {
+      if ((char)(host_sum + b) == 0) host_ready = TRUE;
+      host_state = HOST_IDLE;
+    }
+#endif
 }
 
-/* Writes num_bytes bytes to an I2C device at address addr */
-void i2c_write(char device_addr, char *p, char num_bytes) {
+#ifdef HOST
+/* Serves the frame held by the receiver. A read replies with the image.
+   A write loads the image, leaves any setting mode and commits it with a
+   single EEPROM page write and a single clock burst, then replies with
+   the status and the milliseconds from the first byte of the frame to
+   the end of the commit */
+void host_command(void) {
+  char *image = host_frame + 1;
+  char s, status;
+  unsigned int t;
+  if (host_frame[0] == HOST_READ) {
+    store_image(image);
+#ifndef NO_DEBUG_CLOCK
+    if (debug) {
+      t = debug_time;
+      s = debug_second;
+    } else
+#endif
+    t = rtc_read(&s);
+    image[STORE_SIZE] = s;
+    image[STORE_SIZE+1] = t >> 8;
+    image[STORE_SIZE+2] = t & 0xFF;
+    host_reply(HOST_READ, HOST_IMAGE_SIZE);
+  } else if (host_frame[0] == HOST_HEALTH) {
+    for (s=0; s<HEALTH_COUNT; s++) {
+      image[2*s] = health.count[s] >> 8;
+      image[2*s+1] = health.count[s] & 0xFF;
+    }
+    image[2*s] = health.line >> 8;
+    image[2*s+1] = health.line & 0xFF;
+    host_reply(HOST_HEALTH, HEALTH_DATA_SIZE);
+  } else if (host_frame[0] == HOST_SNAPSHOT && host_length == 2) {
+    t = snapshot_size();
+    s = image[0];
+    if ((unsigned char)s > t) s = t;
+    image[0] = SNAPSHOT_VERSION;
+    image[1] = t;
+    image[2] = s;
+    t -= s;
+    if (t > SNAPSHOT_CHUNK) t = SNAPSHOT_CHUNK;
+    snapshot_copy(image + SNAPSHOT_HEADER, s, t, FALSE);
+    host_reply(HOST_SNAPSHOT, SNAPSHOT_HEADER + t);
+  } else if (host_frame[0] == HOST_RESTORE) {
+    image[0] = host_restore();
+    host_reply(HOST_RESTORE, 1);
+  } else if (host_frame[0] == HOST_RULES && host_length > 1 && (host_length - 1) % RULE_SIZE == 0) {
+    image[0] = host_rules((const struct rule *)image, (host_length - 1) / RULE_SIZE);
+    host_reply(HOST_RULES, 1);
+  } else if (host_frame[0] == HOST_WRITE && host_length == HOST_FRAME_SIZE) {
+    t = ((unsigned char)image[STORE_SIZE+1] << 8) | (unsigned char)image[STORE_SIZE+2];
+    s = image[STORE_SIZE];
+    if (t >= MINUTES_PER_WEEK || (unsigned char)s > 59 || !store_load(image)) {
+      status = HOST_BAD_IMAGE;
+    } else {
+      mode[CLOCK_MODE] = CLOCK;
+      alarm_day = NONE;
+      schedule_write();
+#ifdef FLASH_STORE
+      status = FALSE;               // The flash log uses no I2C
+#else
+      status = i2c_timeout;
+#endif
+      time = t;
+      second = s;
+      time_write_set();
+      status = (status || i2c_timeout) ? HOST_BUS_ERROR : HOST_OK;
+    }
+    DisableInterrupts;
+    t = msec - host_ms;
+    EnableInterrupts;
+    image[0] = status;
+    image[1] = t >> 8;
+    image[2] = t & 0xFF;
+    host_reply(HOST_WRITE, 3);
+  }
+  host_ready = FALSE;
+}
+
+/* Replaces the schedule with the n rules at r and saves it, leaving the
+   clock mode. A rule out of range, or rules that do not all fit, change
+   nothing. Returns the status for the reply */
+char host_rules(const struct rule *r, char n) {
+  char i;
+  for (i=0; i<n; i++) {
+    if (r[i].days == 0 || (r[i].days & ~EVERY_DAY) || r[i].minute >= MINUTES_PER_DAY
+        || (r[i].flags & ~(ALARM_ENABLE | ALARM_ONCE))) return HOST_BAD_IMAGE;
+  }
+  mode[CLOCK_MODE] = CLOCK;
+  alarm_day = NONE;
+  if (!schedule_compile(r, n)) {
+    schedule_read();            // Back to the saved schedule
+    return HOST_BAD_IMAGE;
+  }
+  schedule_write();
+#ifdef FLASH_STORE
+  return HOST_OK;
+#else
+  return i2c_timeout ? HOST_BUS_ERROR : HOST_OK;
+#endif
+}
+
+/* Restores a snapshot sent in order as restore chunks starting at offset
+   0, holding the main loop until the last one so no pass sees half of
+   it. The restored time goes to the clock and the schedule to its store.
+   A bad chunk, a bad schedule, state out of range or a stall abandons the
+   restore, clearing every field it may have written and loading the state
+   again as at power on. Returns the status for the last chunk */
+char host_restore(void) {
+  char *image = host_frame + 1;
+  char size = snapshot_size();
+  char next = 0;
+  char n, k, i;
+  unsigned int t, d;
+  for (;;) {
+    n = host_length - 1 - SNAPSHOT_HEADER;
+    if (host_frame[0] != HOST_RESTORE || host_length <= SNAPSHOT_HEADER
+        || image[0] != SNAPSHOT_VERSION || image[1] != size || image[2] != next
+        || (unsigned char)n > (unsigned char)(size - next)) break;
+    snapshot_copy(image + SNAPSHOT_HEADER, next, n, TRUE);
+    next += n;
+    if (next == size) {
+      if (!store_valid((char *)&store) || !state_valid()) break;
+      schedule_update();
+      time_write();
+      schedule_write();
+      return i2c_timeout ? HOST_BUS_ERROR : HOST_OK;
+    }
+    image[0] = HOST_OK;
+    host_reply(HOST_RESTORE, 1);
+    host_ready = FALSE;
+    DisableInterrupts;
+    t = msec;
+    EnableInterrupts;
+    do {
+      DisableInterrupts;
+      d = msec - t;
+      EnableInterrupts;
+    } while (!host_ready && d <= HOST_TIMEOUT);
+    if (!host_ready) break;
+  }
+  if (next) {
+    for (k=0; k<SNAPSHOT_FIELDS; k++) {
+      for (i=0; i<snapshot_fields[k].bytes; i++) snapshot_fields[k].var[i] = 0;
+    }
+    state_load();
+  }
+  return HOST_BAD_IMAGE;
+}
+
+/* Returns the size of a snapshot */
+char snapshot_size(void) {
+  char k, n = 0;
+  for (k=0; k<SNAPSHOT_FIELDS; k++) n += snapshot_fields[k].bytes;
+  return n;
+}
+
+/* Copies n bytes of the snapshot from offset o between b and the state,
+   into the state when restore is set */
+void snapshot_copy(char *b, char o, char n, char restore) {
+  char k, i;
+  for (k=0; k<SNAPSHOT_FIELDS && n; k++) {
+    for (i=0; i<snapshot_fields[k].bytes && n; i++) {
+      if (o) {
+        o--;
+        continue;
+      }
+      if (restore) snapshot_fields[k].var[i] = *b++;
+      else *b++ = snapshot_fields[k].var[i];
+      n--;
+    }
+  }
+}
+
+/* Writes a host frame of command c and the n payload bytes that follow
+   the command in host_frame */
+void host_reply(char c, char n) {
+  char i, sum = n + 1;
+  host_frame[0] = c;
+  sci_write(0xFF);              // Header
+  sci_write(HOST_HEADER);
+  sci_write(n + 1);             // Length
+  for (i=0; i<=n; i++) {
+    sci_write(host_frame[i]);
+    sum += host_frame[i];
+  }
+  sci_write(-sum);              // Checksum
+}
+#endif
+
+/* Writes header_bytes bytes from h, the register or memory address, and
+   then num_bytes bytes from p to an I2C device at address addr */
+void i2c_write(char device_addr, char *h, char header_bytes, char *p, char num_bytes) {
+  PROF_BEGIN(PROF_I2C);
   i2c_start_timeout();          // Start I2C watchdog timer
-  assert(num_bytes >= 1);
+  assert(header_bytes >= 1);
   while (MIMCR_MMBB)  {         // Wait for bus not busy
     if (i2c_timeout) return;
   }
   if (i2c_timeout) return;
   MMSR_MMTXIF = 0;              // Set MMDRR writable
   MIMCR_MMRW = 0;               // Set for transmit
+  i2c_device = device_addr;
+  BUS_EVENT_MAIN(BUS_I2C_START, device_addr);
+  ENERGY_ADD(ENERGY_I2C, CHARGE_I2C);
   MMADR = device_addr;          // Device address -> address reg
-  MMDTR = *p++;                 // First byte of data to write
+  MMDTR = *h++;                 // First byte of the header to write
+  num_bytes += header_bytes--;  // Bytes left to write, counting the dummy
   MIMCR_MMAST = 1;              // Start transmission
   while (MMSR_MMRXAK)  {
     if (i2c_timeout) return;
@@ -1115,7 +2664,10 @@ void i2c_write(char device_addr, char *p, char num_bytes) {
     if (i2c_timeout) return;
     if (num_bytes == 0)         // Is this the last byte?
       MMDTR = 0xFF;             // Yes. dummy data -> DTR
-    else
+    else if (header_bytes > 0) {
+      MMDTR = *h++;             // No. next header -> DTR
+      header_bytes--;
+    } else
       MMDTR = *p++;             // No. next data -> DTR
     while (MMSR_MMRXAK) {       // Wait for ACK from slave
       if (i2c_timeout) return;
@@ -1123,11 +2675,14 @@ void i2c_write(char device_addr, char *p, char num_bytes) {
     if (i2c_timeout) return;
   }
   MIMCR_MMAST = 0;              // Generate STOP bit
+  BUS_EVENT_MAIN(BUS_I2C_STOP, FALSE);
   T1SC_TSTOP = 1;               // Stop I2C watchdog timer
+  PROF_END(PROF_I2C);
 }
 
 /* Read num_bytes bytes from an I2C device at address addr */
 void i2c_read(char device_addr, char *p, char num_bytes) {
+    PROF_BEGIN(PROF_I2C);
     i2c_start_timeout();        // Start I2C watchdog timer
     assert(num_bytes >= 1);     
     while (MIMCR_MMBB) {
@@ -1140,6 +2695,9 @@ void i2c_read(char device_addr, char *p, char num_bytes) {
       MMCR_MMTXAK = 1;
     else
       MMCR_MMTXAK = 0;
+    i2c_device = device_addr;
+    BUS_EVENT_MAIN(BUS_I2C_START, device_addr | 1);
+    ENERGY_ADD(ENERGY_I2C, CHARGE_I2C);
     MMADR = device_addr;        // Device address -> address reg
     MMDTR = 0xFF;               // Dummy data to get ACK clock
     MIMCR_MMAST = 1;            // Initiate transfer    
@@ -1160,14 +2718,20 @@ void i2c_read(char device_addr, char *p, char num_bytes) {
         *p++ = MMDRR;           // Get data
     }
     MIMCR_MMAST = 0;            // Generate STOP bit
+    BUS_EVENT_MAIN(BUS_I2C_STOP, FALSE);
     T1SC_TSTOP = 1;             // Start I2C watchdog timer
+    PROF_END(PROF_I2C);
 }                               
 
 /* Reset the I2C bus if the I2C watchdog timer expired */
 void i2c_reset(void) {
+    T1SC_TSTOP = 1;             // Stop I2C watchdog timer, one count per failure
     MMCR_MMEN = 0;
     MMCR_MMEN = 1;
     i2c_timeout = TRUE;
+    BUS_EVENT(BUS_I2C_STOP, TRUE);
+    health_count(i2c_device == CLOCK_ADDR ? HEALTH_CLOCK_TIMEOUT : HEALTH_EEPROM_TIMEOUT);
+    PROF_END(PROF_I2C);         // Timed out transactions count too
 }
 
 /* Start the I2C watchdog timer */
@@ -1185,4 +2749,730 @@ void i2c_start_timeout(void) {
 void i2c_watchdog(void) {
     T1SC_TOF = 0;               // Reenable timer
     i2c_reset();
-}
\ No newline at end of file
+}
+
+/* The ISR for Timer 2 channel 0, runs the input debouncer every
+   millisecond and the sound patterns every SOUND_UNIT milliseconds */
+#pragma TRAP_PROC
+void ms_tick(void) {
+    unsigned int next = T2CH0 + DEBOUNCE_PERIOD;
+    T2SC0_CH0F = 0;             // Reenable channel
+    if (next >= TICK_MODULO) next -= TICK_MODULO;
+    T2CH0 = next;               // Next sample, in step with the tick
+    msec++;
+    debounce();
+    if (++sound_div == SOUND_UNIT) {
+      sound_div = 0;
+      sound_tick();
+#ifdef ENERGY
+      if (sound_on) energy_sound++;
+#endif
+    }
+}
+
+/* Samples the inputs and only passes a sample on once it has held still
+   for DEBOUNCE_COUNT samples, so contact bounce never reaches the buttons */
+void debounce(void) {
+    char raw = input | switches;
+    if (raw != debounce_raw) {
+      debounce_raw = raw;
+      debounce_count = 0;
+#ifdef LATENCY
+      debounce_ms = msec;
+#endif
+    } else if (debounce_count < DEBOUNCE_COUNT && ++debounce_count == DEBOUNCE_COUNT) {
+#ifdef LATENCY
+      /* A new button is down, start timing from its first sample */
+      if ((raw & INPUT_MASK) != 0 && (raw & INPUT_MASK) != (debounced & INPUT_MASK)) {
+        latency_start[LATENCY_BEEP] = debounce_ms;
+        latency_start[LATENCY_DISPLAY] = debounce_ms;
+        latency_pending |= (1 << LATENCY_BEEP) | (1 << LATENCY_DISPLAY);
+      }
+      
+      /* The buttons are up while the alarm sounds, time the snooze */
+      else if ((raw & INPUT_MASK) == 0 && (debounced & INPUT_MASK) != 0
+               && mode[CLOCK_MODE] == ACTIVATE_ALARM) {
+        latency_start[LATENCY_SILENCE] = debounce_ms;
+        latency_pending |= 1 << LATENCY_SILENCE;
+      }
+#endif
+      debounced = raw;
+    }
+}
+
+/* Starts pattern p on sound channel k from its first step */
+void sound_start(char k, const struct step *p) {
+  DisableInterrupts;
+  sound_step[k] = p;
+  sound_count[k] = p->count;
+  sound_timer[k] = p->on;
+  sound_on |= 1 << k;
+  sound_latch(k);
+  EnableInterrupts;
+  if (k == SOUND_BEEP) LATENCY_MARK(LATENCY_BEEP);
+  else if (k == SOUND_ALARM) LATENCY_MARK(LATENCY_ALARM);
+}
+
+/* Silences sound channel k */
+void sound_stop(char k) {
+  DisableInterrupts;
+  sound_step[k] = 0;
+  sound_on &= ~(1 << k);
+  sound_latch(k);
+  EnableInterrupts;
+  if (k == SOUND_ALARM) LATENCY_MARK(LATENCY_SILENCE);
+}
+
+/* Advances every playing pattern by one unit, relatching the channels
+   that turn on or off. Runs in the ISR */
+void sound_tick(void) {
+  char k, on;
+  const struct step *s;
+  for (k=0; k<SOUND_COUNT; k++) {
+    s = sound_step[k];
+    if (s == 0 || --sound_timer[k] != 0) continue;
+    on = sound_on & (1 << k);
+    if (on && s->off != 0) {
+      /* Quiet half of the step */
+      sound_timer[k] = s->off;
+      sound_on &= ~(1 << k);
+    } else {
+      /* Next repeat, or the next step once this one has run out */
+      if (s->count != 0 && --sound_count[k] == 0) {
+        sound_step[k] = ++s;
+        sound_count[k] = s->count;
+      }
+      sound_timer[k] = s->on;
+      if (s->on == 0) {
+        sound_step[k] = 0;
+        sound_on &= ~(1 << k);
+      } else sound_on |= 1 << k;
+    }
+    if ((sound_on & (1 << k)) != on) sound_latch(k);
+  }
+}
+
+/* Relatches the output bank of sound channel k, interrupts must be off */
+void sound_latch(char k) {
+  char a = sound_addr[k];
+  data = output[a - OUTPUT0_ADDR] | sound_bits(a);
+  addr = a;
+  addr = SEND;
+  BUS_EVENT(BUS_LATCH | a, data);
+}
+
+/* Returns the bits of the sounding channels that live at latch address a */
+char sound_bits(char a) {
+  char k, b = 0;
+  for (k=0; k<SOUND_COUNT; k++) {
+    if (sound_addr[k] == a && (sound_on & (1 << k))) b |= sound_mask[k];
+  }
+  return b;
+}
+
+#ifdef BENCHMARK
+#define BENCH_RUNS      16      // Calls averaged per benchmark
+
+/* The blocking operations timed for the worst case pass, in Timer 2
+   counts at divide by 4 so a tick is TICK_MODULO counts */
+#define WCET_TIME_READ  0       // time_read()
+#define WCET_TIME_WRITE 1       // time_write()
+#define WCET_TIME_SET   2       // time_write_set()
+#define WCET_STORE      3       // schedule_write(), the flash log erasing a page
+#define WCET_HEALTH     4       // health_save()
+#define WCET_OPS        5
+#define WCET_RUNS       2       // Calls timed, the second waits out the first's write cycle
+#define WCET_SCI_BYTE   320     // Ten bits at 19200 baud, 128 bus cycles each
+#define WCET_IPOD_CMD   8       // Bytes in the longest iPod command
+#define WCET_HOST_REPLY 5       // Header, length, command and checksum around the data
+#define WCET(k)         (1 << (k))
+
+unsigned int wcet_op[WCET_OPS];         // Slowest call of each operation
+unsigned int wcet_loop[CLOCK_MODES];    // Average pass in each UI state
+
+/* The blocking work a pass can add to its benchmark, timed above. Which
+   operations each path runs follows loop() and host_command(), the
+   debug report and the restore wait for the host are left out */
+struct wcet {
+  char ops;                     // Timed operations, a WCET() bit each
+  char sci;                     // SCI bytes sent
+};
+#define WCET_PASS       0       // Rows of wcet_paths
+#define WCET_HOST_READ  1
+#define WCET_HOST_WRITE 2
+#define WCET_STATE      3       // The first of a row per UI state
+const struct wcet wcet_paths[] = {
+  /* Every pass: the health save, the time written when the debug switch
+     flips and the button release when the off timer expires */
+  { WCET(WCET_HEALTH) | WCET(WCET_TIME_WRITE), WCET_IPOD_CMD },
+  /* A host read: the time read and the image replied, longer than any
+     other host reply */
+  { WCET(WCET_TIME_READ), WCET_HOST_REPLY + HOST_IMAGE_SIZE },
+  /* A host write: the store and the time written, the status replied */
+  { WCET(WCET_STORE) | WCET(WCET_TIME_SET), WCET_HOST_REPLY + 3 },
+  /* CLOCK: a one shot alarm removed and the iPod played */
+  { WCET(WCET_STORE), 4*WCET_IPOD_CMD },
+  /* SET_CLOCK_HOUR and SET_CLOCK_MIN: nothing blocks */
+  { 0, 0 },
+  { 0, 0 },
+  /* SET_DAY: the time and the set flag written */
+  { WCET(WCET_TIME_SET), 0 },
+  /* SET_ALARM_HOUR: nothing blocks */
+  { 0, 0 },
+  /* SET_ALARM_MIN: the alarm saved */
+  { WCET(WCET_STORE), 0 },
+  /* VIEW_ALARM: as CLOCK */
+  { WCET(WCET_STORE), 4*WCET_IPOD_CMD },
+  /* ENABLE_ALARM: the alarm saved */
+  { WCET(WCET_STORE), 0 },
+  /* ACTIVATE_ALARM: the iPod turned off */
+  { 0, 3*WCET_IPOD_CMD }
+};
+
+/* Times BENCH_RUNS executions of op with Timer 2 counting bus cycles */
+#define BENCH(name, op) {\
+                          total = 0;\
+                          for (k=0; k<BENCH_RUNS; k++) {\
+                            start = T2CNT;\
+                            op;\
+                            total += (unsigned int)(T2CNT - start);\
+                          }\
+                          bench_report(name, total, overhead);\
+                        }
+
+/* Times the slowest of WCET_RUNS executions of op into wcet_op[k] */
+#define WCET_TIME(k, op) {\
+                           wcet_op[k] = 0;\
+                           for (n=0; n<WCET_RUNS; n++) {\
+                             start = T2CNT;\
+                             op;\
+                             d = T2CNT - start;\
+                             if (d > wcet_op[k]) wcet_op[k] = d;\
+                           }\
+                         }
+
+const char * const bench_modes[] = {
+  "loop_clock", "loop_set_clock_hour", "loop_set_clock_min", "loop_set_day",
+  "loop_set_alarm_hour", "loop_set_alarm_min", "loop_view_alarm",
+  "loop_enable_alarm", "loop_activate_alarm"
+};
+
+/* Measures the cost of the hot functions and of one main loop pass in each
+   mode, and reports them over the SCI as "name,cycles" lines after a
+   "features,..." line naming what the build left in. Then times the
+   blocking operations for the worst case pass report */
+void bench(void) {
+  char k, m, n;
+  unsigned int start, overhead, d;
+  unsigned long total;
+  
+  sci_print("features");
+#ifndef NO_DEBUG_CLOCK
+  sci_print(",debug_clock");
+#endif
+#ifndef NO_12_HOUR
+  sci_print(",12_hour");
+#endif
+#ifndef NO_BUZZER
+  sci_print(",buzzer");
+#endif
+#ifndef NO_IPOD
+  sci_print(",ipod");
+#endif
+  sci_print("\r\n");
+  
+  /* Count bus cycles */
+  T2SC_TRST = 1;                // Reset timer
+  T2SC_PS = 0;                  // Set prescalar for divide by 1
+  T2SC_TOIE = 0;                // Disable timer interrupt
+  T2MOD = 0xFFFF;               // Free running counter
+  T2SC_TSTOP = 0;               // Start timer running
+  
+  /* Cost of the measurement itself */
+  overhead = 0;
+  BENCH("empty", ;);
+  overhead = total / BENCH_RUNS;
+  
+  /* Helpers */
+  BENCH("dec2bcd", dec2bcd(59));
+  BENCH("sn", sn(0x59));
+  BENCH("time_format", time_format(23));
+  BENCH("alarm_check", alarm_check());
+  BENCH("schedule_find", schedule_find(time));
+  
+  /* Buttons, with SEL held down and the rest released */
+  buttons[SEL-1][STATUS] = PRESSED;
+  BENCH("scan", scan());
+  BENCH("held", held(SEL, 20, LOCK_BUTTON, BEEP));
+  BENCH("released", released(DOWN, 0, NO_BEEP));
+  for (k=0; k<INPUT_COUNT; k++) {
+    buttons[k][STATUS] = RELEASED;
+  }
+  scan();
+  sound_stop(SOUND_BEEP);
+  
+  /* Display, with the worst case flashing */
+  control = FLASH_HOUR | FLASH_ALARM_DAY;
+  BENCH("flush", flush());
+  
+  /* Main loop, skipping ENABLE_ALARM which writes the EEPROM every pass.
+     It takes the slowest of the others for the worst case */
+  for (m=CLOCK; m<=ACTIVATE_ALARM; m++) {
+    if (m == ENABLE_ALARM) continue;
+    alarm_day = (m == VIEW_ALARM) ? SUN : NONE;
+    BENCH(bench_modes[m], view = TRUE; mode[CLOCK_MODE] = m; loop());
+    wcet_loop[m] = total / (4 * BENCH_RUNS);
+    if (wcet_loop[m] > wcet_loop[ENABLE_ALARM]) wcet_loop[ENABLE_ALARM] = wcet_loop[m];
+  }
+  
+  /* Back to a clean clock */
+  mode[CLOCK_MODE] = CLOCK;
+  alarm_day = NONE;
+  view = FALSE;
+  control = NONE;
+  
+  /* Blocking operations, which outlast a Timer 2 wrap at divide by 1 */
+  T2SC_TRST = 1;                // Reset timer
+  T2SC_PS = 2;                  // Set prescalar for divide by 4
+  WCET_TIME(WCET_TIME_READ, time_read());
+  WCET_TIME(WCET_TIME_WRITE, time_write());
+  m = clock_set;
+  WCET_TIME(WCET_TIME_SET, time_write_set());
+  time_volatile(m);             // Leave the set flag as it was
+#ifdef FLASH_STORE
+  flash_next = 0;               // The first save erases a page, the newest record kept
+#endif
+  WCET_TIME(WCET_STORE, schedule_write());
+  WCET_TIME(WCET_HEALTH, health_save());
+  
+  wcet_report();
+}
+
+/* Returns the time path i blocks for in Timer 2 counts at divide by 4 */
+unsigned long wcet_bound(char i) {
+  const struct wcet *p = &wcet_paths[i];
+  unsigned long t = (unsigned long)p->sci * WCET_SCI_BYTE;
+  char k;
+  for (k=0; k<WCET_OPS; k++) {
+    if (p->ops & WCET(k)) t += wcet_op[k];
+  }
+  return t;
+}
+
+/* Returns the worst case time of a pass in UI state m in Timer 2 counts
+   at divide by 4, its benchmark and the blocking it can add, the slower
+   host command included */
+unsigned long wcet_pass(char m) {
+  unsigned long t = wcet_loop[m] + wcet_bound(WCET_PASS) + wcet_bound(WCET_STATE + m);
+#ifdef HOST
+  unsigned long r = wcet_bound(WCET_HOST_READ);
+  unsigned long w = wcet_bound(WCET_HOST_WRITE);
+  t += r > w ? r : w;
+#endif
+  return t;
+}
+
+/* Writes the worst case time of a pass in each UI state as
+   "wcet,state,ms,deadline_ms" lines rounded up, and a "wcet,fail" line
+   when one overruns the tick */
+void wcet_report(void) {
+  char m;
+  unsigned long t;
+  char fail = FALSE;
+  for (m=CLOCK; m<=ACTIVATE_ALARM; m++) {
+    t = wcet_pass(m);
+    sci_print("wcet,");
+    sci_dec(m);
+    sci_write(',');
+    sci_dec((t * TICK_MS + TICK_MODULO - 1) / TICK_MODULO);
+    sci_write(',');
+    sci_dec(TICK_MS);
+    sci_print("\r\n");
+    if (t > TICK_MODULO) fail = TRUE;
+  }
+  if (fail) sci_print("wcet,fail\r\n");
+}
+
+/* Writes the per call cost of a benchmark to the SCI port */
+void bench_report(const char *name, unsigned long total, unsigned int overhead) {
+  unsigned int cycles = total / BENCH_RUNS;
+  sci_print(name);
+  sci_write(',');
+  sci_dec(cycles > overhead ? cycles - overhead : 0);
+  sci_print("\r\n");
+}
+#endif
+
+#ifdef PROFILE
+/* Adds the time since phase p began to its histogram */
+void prof_record(char p) {
+  unsigned int t = T2CNT;
+  char b = 0;
+  
+  /* Timer 2 wraps at the tick modulo */
+  if (t >= prof_start[p]) t -= prof_start[p];
+  else t += TICK_MODULO + 1 - prof_start[p];
+  
+  if (t > prof_max[p]) prof_max[p] = t;
+  
+  /* Each bucket is 4 times as wide as the last */
+  t >>= 6;
+  while (t && b < PROF_BUCKETS-1) {
+    t >>= 2;
+    b++;
+  }
+  if (prof_hist[p][b] < 0xFFFF) prof_hist[p][b]++;
+}
+
+/* Writes and clears the phase histograms over the SCI port as
+   "prof,phase,max,bucket0,...,bucket5" lines, max in Timer 2 counts */
+void prof_report(void) {
+  char p, b;
+  for (p=0; p<PROF_COUNT; p++) {
+    sci_print("prof,");
+    sci_dec(p);
+    sci_write(',');
+    sci_dec(prof_max[p]);
+    prof_max[p] = 0;
+    for (b=0; b<PROF_BUCKETS; b++) {
+      sci_write(',');
+      sci_dec(prof_hist[p][b]);
+      prof_hist[p][b] = 0;
+    }
+    sci_print("\r\n");
+  }
+}
+#endif
+
+#ifdef TRACE
+/* Samples the inputs and the clock for this tick and records whatever
+   changed since the last record. Unchanged ticks only bump the idle count
+   carried in the next tag, so a quiet clock costs a byte every 16 ticks */
+void trace_tick(void) {
+  char tag = 0;
+  
+  sample = debounced;
+  rtc_time = rtc_read(&rtc_second);
+  
+  if (sample != trace_sample) tag |= TRACE_SAMPLE;
+  if (rtc_time != trace_time) tag |= TRACE_TIME;
+  else if (rtc_second == trace_second+1) tag |= TRACE_SEC;
+  else if (rtc_second != trace_second) tag |= TRACE_TIME;
+  
+  if (tag == 0 && trace_idle < TRACE_IDLE_MAX) {
+    trace_idle++;
+    return;
+  }
+  
+  sci_write((trace_idle << 4) | tag);
+  trace_idle = 0;
+  if (tag & TRACE_SAMPLE) {
+    sci_write(sample);
+    trace_sample = sample;
+  }
+  if (tag & TRACE_TIME) {
+    sci_write(rtc_second);
+    sci_write(rtc_time >> 8);
+    sci_write(rtc_time & 0xFF);
+  }
+  trace_time = rtc_time;
+  trace_second = rtc_second;
+}
+#endif
+
+#ifdef TICK_LOCKED
+/* Records the display latches if this pass changed any of them */
+void trace_display(void) {
+  char i;
+  if (!shown_changed) return;
+  shown_changed = FALSE;
+  sci_write(TRACE_DISPLAY);
+  for (i=0; i<LATCH_COUNT; i++) sci_write(shown[i]);
+}
+#endif
+
+#ifdef REPLAY
+/* Applies the next trace record once its idle ticks have passed. The
+   display records and iPod frames of the recording are skipped, the
+   device writes its own so its output can be diffed against the trace */
+void replay_tick(void) {
+  if (replay_wait == 0) {
+    replay_tag = replay_read_tag();
+    replay_wait = (replay_tag >> 4) + 1;
+  }
+  if (--replay_wait > 0) return;
+  
+  if (replay_tag & TRACE_SAMPLE) sample = sci_read();
+  if (replay_tag & TRACE_TIME) {
+    rtc_second = sci_read();
+    rtc_time = sci_read() << 8;
+    rtc_time |= sci_read();
+  }
+  if (replay_tag & TRACE_SEC) rtc_second++;
+  
+  replay_tag = replay_read_tag();
+  replay_wait = (replay_tag >> 4) + 1;
+}
+
+/* Reads the next input record tag, skipping the records in between */
+char replay_read_tag(void) {
+  char b, i;
+  for (;;) {
+    b = sci_read();
+    if (b == (char)0xFF) {
+      /* iPod frame: header, length, mode and command bytes, checksum */
+      sci_read();
+      b = sci_read();
+      for (i=0; i<=b; i++) sci_read();
+    } else if (b == TRACE_DISPLAY) {
+      for (i=0; i<LATCH_COUNT; i++) sci_read();
+    } else return b;
+  }
+}
+#endif
+
+#ifdef REPORTING
+/* Writes the debug report over the SCI port */
+void report(void) {
+  report_busy = TRUE;
+#ifdef BUS_LOG
+  bus_report();
+#endif
+#ifdef ENERGY
+  energy_report();
+#endif
+#ifdef PROFILE
+  prof_report();
+#endif
+#ifdef STACK_CHECK
+  stack_report();
+#endif
+#ifdef LATENCY
+  latency_report();
+#endif
+  schedule_report();
+  health_report();
+  report_busy = FALSE;
+}
+
+#ifdef ENERGY
+/* Counts an activity of kind k costing charge q in the current mode */
+void energy_add(char k, unsigned int q) {
+  if (energy_ticks[mode[CLOCK_MODE]] >= ENERGY_TICK_MAX) return;
+  energy_charge[mode[CLOCK_MODE]] += q;
+  if (energy_count[k] != 0xFFFF) energy_count[k]++;
+}
+
+/* Charges the tick and the sound since the last one to the current mode.
+   A mode stops counting at ENERGY_TICK_MAX, before its charge overflows,
+   until the report clears it */
+void energy_tick(void) {
+  char m = mode[CLOCK_MODE];
+  unsigned int s;
+  DisableInterrupts;
+  s = energy_sound;
+  energy_sound = 0;
+  EnableInterrupts;
+  if (energy_ticks[m] >= ENERGY_TICK_MAX) return;
+  energy_ticks[m]++;
+  energy_charge[m] += (unsigned long)CPU_UA * TICK_MS + (unsigned long)s * SOUND_UA * SOUND_UNIT;
+  if (energy_count[ENERGY_SOUND] <= 0xFFFF - s) energy_count[ENERGY_SOUND] += s;
+}
+
+/* Writes and clears the energy model as "energy,mode,ticks,uA,hours"
+   lines for each mode seen, then the mix of them all and its activity
+   counts as "energy,all,ticks,uA,hours,i2c,sci,latch,sound" */
+void energy_report(void) {
+  char m;
+  unsigned int n = 0;
+  unsigned long q = 0;
+  for (m=0; m<ENERGY_MODES; m++) {
+    if (energy_ticks[m] == 0) continue;
+    sci_print("energy,");
+    sci_dec(m);
+    energy_line(energy_ticks[m], energy_charge[m]);
+    sci_print("\r\n");
+    n += energy_ticks[m];
+    q += energy_charge[m];
+    energy_ticks[m] = 0;
+    energy_charge[m] = 0;
+  }
+  sci_print("energy,all");
+  energy_line(n, q);
+  for (m=0; m<ENERGY_KINDS; m++) {
+    sci_write(',');
+    sci_dec(energy_count[m]);
+    energy_count[m] = 0;
+  }
+  sci_print("\r\n");
+}
+
+/* Writes ",ticks,uA,hours" for n ticks costing charge q, the hours being
+   the battery life at that average current */
+void energy_line(unsigned int n, unsigned long q) {
+  unsigned long ua = n ? q / ((unsigned long)n * TICK_MS) : 0;
+  unsigned long h = ua ? (unsigned long)BATTERY_MAH * 1000 / ua : 0xFFFF;
+  sci_write(',');
+  sci_dec(n);
+  sci_write(',');
+  sci_dec(ua);
+  sci_write(',');
+  sci_dec(h > 0xFFFF ? 0xFFFF : h);
+}
+#endif
+
+#ifdef BUS_LOG
+/* Logs a bus event of kind k and value v, called with interrupts off */
+void bus_log(char k, char v) {
+  struct bus_event *e;
+  if (report_busy) return;
+  e = &bus_events[bus_head++ & (BUS_LOG_SIZE-1)];
+  if (bus_count < BUS_LOG_SIZE) bus_count++;
+  e->ms = msec;
+  e->count = T2CNT;
+  e->kind = k;
+  e->value = v;
+}
+
+/* Writes and clears the logged bus events, oldest first, as
+   "bus,ms,count,kind,value" lines, count in Timer 2 counts of 1.6us */
+void bus_report(void) {
+  char i, n;
+  struct bus_event *e;
+  for (i=bus_head-bus_count, n=bus_count; n; i++, n--) {
+    e = &bus_events[i & (BUS_LOG_SIZE-1)];
+    sci_print("bus,");
+    sci_dec(e->ms);
+    sci_write(',');
+    sci_dec(e->count);
+    sci_write(',');
+    sci_dec(e->kind);
+    sci_write(',');
+    sci_dec(e->value);
+    sci_print("\r\n");
+  }
+  bus_count = 0;
+}
+#endif
+
+/* Writes the health counters as "health,count0,...,count10,line" */
+void health_report(void) {
+  char k;
+  sci_print("health");
+  for (k=0; k<HEALTH_COUNT; k++) {
+    sci_write(',');
+    sci_dec(health.count[k]);
+  }
+  sci_write(',');
+  sci_dec(health.line);
+  sci_print("\r\n");
+}
+
+/* Writes the schedule size and the steps the last lookup took as
+   "sched,entries,bytes,steps" */
+void schedule_report(void) {
+  sci_print("sched,");
+  sci_dec(schedule_count);
+  sci_write(',');
+  sci_dec(1 + ALARM_SIZE*schedule_count);
+  sci_write(',');
+  sci_dec(schedule_steps);
+  sci_print("\r\n");
+}
+#endif
+
+#ifdef LATENCY
+/* Starts measurement k from msec t */
+void latency_begin(char k, unsigned int t) {
+  DisableInterrupts;
+  latency_start[k] = t;
+  latency_pending |= 1 << k;
+  EnableInterrupts;
+}
+
+/* Takes measurement k if it is waiting, into its histogram and against
+   its budget */
+void latency_mark(char k) {
+  unsigned int d;
+  char b = 0;
+  DisableInterrupts;
+  if (!(latency_pending & (1 << k))) {
+    EnableInterrupts;
+    return;
+  }
+  latency_pending &= ~(1 << k);
+  d = msec - latency_start[k];
+  EnableInterrupts;
+  if (d > LATENCY_WINDOW) return;
+  latency_last[k] = d;
+  if (d > latency_max[k]) latency_max[k] = d;
+  if (d > latency_budget[k] && latency_over[k] != 0xFFFF) latency_over[k]++;
+  for (d>>=3; d && b<LATENCY_BUCKETS-1; d>>=1) b++;
+  if (latency_hist[k][b] != 0xFFFF) latency_hist[k][b]++;
+}
+
+/* Returns the upper bound in milliseconds of the bucket holding the p
+   percentile of measurement k, its max for the open top bucket */
+unsigned int latency_percentile(char k, char p) {
+  unsigned long n = 0, c = 0;
+  char b;
+  for (b=0; b<LATENCY_BUCKETS; b++) n += latency_hist[k][b];
+  if (n == 0) return 0;         // Nothing measured yet
+  for (b=0; b<LATENCY_BUCKETS-1; b++) {
+    c += latency_hist[k][b];
+    if (c * 100 >= n * p) return 8 << b;
+  }
+  return latency_max[k];
+}
+
+/* Writes a "latency,k,last,max,p50,p99,over" line for each measurement,
+   in milliseconds, and a "latency,fail" line when any went over budget */
+void latency_report(void) {
+  char k, fail = FALSE;
+  for (k=0; k<LATENCY_COUNT; k++) {
+    sci_print("latency,");
+    sci_dec(k);
+    sci_write(',');
+    sci_dec(latency_last[k]);
+    sci_write(',');
+    sci_dec(latency_max[k]);
+    sci_write(',');
+    sci_dec(latency_percentile(k, 50));
+    sci_write(',');
+    sci_dec(latency_percentile(k, 99));
+    sci_write(',');
+    sci_dec(latency_over[k]);
+    sci_print("\r\n");
+    if (latency_over[k]) fail = TRUE;
+  }
+  if (fail) sci_print("latency,fail\r\n");
+}
+#endif
+
+#ifdef STACK_CHECK
+/* Fills the stack below the current frame with the sentinel, the stack
+   grows down so every painted byte above the start is still unused */
+void stack_paint(void) {
+  char mark;
+  char *p = __SEG_START_SSTACK;
+  while (p < &mark - STACK_MARGIN) *p++ = STACK_PAINT;
+}
+
+/* Writes the deepest stack use seen since boot as "stack,used,size",
+   found by counting the sentinel bytes that are still intact, and the
+   RAM left over for queues after the variables and the stack as
+   "ram,free,size" */
+void stack_report(void) {
+  char *p = __SEG_START_SSTACK;
+  while (p < __SEG_END_SSTACK && *p == (char)STACK_PAINT) p++;
+  sci_print("stack,");
+  sci_dec(__SEG_END_SSTACK - p);
+  sci_write(',');
+  sci_dec(__SEG_END_SSTACK - __SEG_START_SSTACK);
+  sci_print("\r\nram,");
+  sci_dec(RAM_SIZE - (unsigned int)__SEG_SIZE_DEFAULT_RAM - (unsigned int)__SEG_SIZE_SSTACK);
+  sci_write(',');
+  sci_dec(RAM_SIZE);
+  sci_print("\r\n");
+}
+#endif